@@ -0,0 +1,342 @@
+/**
+ * --------------------------------------------------------
+ * Micro benchmark of the BLE-MIDI encoder and decoder, using the loopback backend
+ * (no BLE stack needed). Reports ns/packet and messages/sec for a number of typical
+ * streams, so regressions in the hot path show up before flashing hardware.
+ *
+ * Runs on a board (results are printed on Serial), or natively on a PC:
+ *
+ *   g++ -std=c++11 -O2 -x c++ Loopback_Benchmark.ino \
+ *       -I../../src -I<path to arduino_midi_library>/src -o benchmark && ./benchmark [corpus.txt]
+ *
+ * The optional corpus (one packet per line, in hex) is written by Loopback_Fuzz.
+ * --------------------------------------------------------
+ */
+
+#include <BLEMIDI_Transport.h>
+
+#include <hardware/BLEMIDI_Loopback.h>
+
+#if ARDUINO
+static const unsigned long Iterations = 1000;
+static uint64_t nowNs() { return (uint64_t)micros() * 1000; }
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+static const unsigned long Iterations = 200000;
+static uint64_t nowNs() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// count heap allocations, the receive and transmit paths should not make any
+// (of the transport and this backend: how a BLE backend gets the packet from its stack is not measured)
+static unsigned long allocations = 0;
+
+void *operator new(size_t size)
+{
+    allocations++;
+    if (void *p = malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
+BLEMIDI_CREATE_DEFAULT_INSTANCE()
+
+struct CoalescingSettings : public BLEMIDI_NAMESPACE::DefaultSettings
+{
+    static const bool UseTxCoalescing = true;
+};
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Loopback-Coalescing", MIDI_Coalescing, CoalescingSettings)
+
+struct RunningStatusSettings : public CoalescingSettings
+{
+    static const bool UseTxRunningStatus = true;
+};
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Loopback-RunningStatus", MIDI_RunningStatus, RunningStatusSettings)
+
+// 20 Control Changes, running status
+byte runningStatusPacket[] = {0x80, 0x80, 0xB0, 0x07, 0x00,
+                              0x07, 0x01, 0x07, 0x02, 0x07, 0x03, 0x07, 0x04, 0x07, 0x05, 0x07, 0x06,
+                              0x07, 0x07, 0x07, 0x08, 0x07, 0x09, 0x07, 0x0A, 0x07, 0x0B, 0x07, 0x0C,
+                              0x07, 0x0D, 0x07, 0x0E, 0x07, 0x0F, 0x07, 0x10, 0x07, 0x11, 0x07, 0x12,
+                              0x07, 0x13};
+
+// NoteOn, ControlChange, ProgramChange, PitchBend, AfterTouchChannel, NoteOff
+byte mixedPacket[] = {0x80, 0x80, 0x90, 0x3C, 0x64,
+                      0x81, 0xB0, 0x07, 0x40,
+                      0x82, 0xC0, 0x05,
+                      0x83, 0xE0, 0x00, 0x40,
+                      0x84, 0xD0, 0x30,
+                      0x85, 0x80, 0x3C, 0x00};
+
+// NoteOn's interleaved with Timing Clock
+byte realtimePacket[] = {0x80, 0x80, 0x90, 0x3C, 0x64,
+                         0x80, 0xF8,
+                         0x81, 0x90, 0x3E, 0x64,
+                         0x81, 0xF8,
+                         0x82, 0x90, 0x40, 0x64,
+                         0x82, 0xF8,
+                         0x83, 0x90, 0x43, 0x64,
+                         0x83, 0xF8};
+
+byte sysEx[1024];
+
+unsigned long drained = 0;
+
+static void drain()
+{
+    while (BLEMIDI.available())
+    {
+        BLEMIDI.read();
+        drained++;
+    }
+}
+
+static unsigned long allocationsAtStart = 0;
+
+static uint64_t start()
+{
+#if !ARDUINO
+    allocationsAtStart = allocations;
+#endif
+    return nowNs();
+}
+
+static void report(const char *name, unsigned long packets, unsigned long messages, uint64_t ns, bool ok)
+{
+    char line[112];
+#if ARDUINO
+    snprintf(line, sizeof(line), "%-28s %8lu ns/packet %10lu msg/s %s",
+             name,
+             (unsigned long)(ns / packets),
+             (unsigned long)(messages * 1000000000ULL / ns),
+             ok ? "" : "FAILED");
+    Serial.println(line);
+#else
+    auto allocs = allocations - allocationsAtStart;
+    snprintf(line, sizeof(line), "%-28s %8lu ns/packet %10lu msg/s %6lu allocs %s",
+             name,
+             (unsigned long)(ns / packets),
+             (unsigned long)(messages * 1000000000ULL / ns),
+             allocs,
+             ok && allocs == 0 ? "" : "FAILED");
+    puts(line);
+#endif
+}
+
+static void benchDecode(const char *name, byte *packet, size_t length, unsigned long messagesPerPacket, unsigned long bytesPerPacket)
+{
+    drained = 0;
+    auto t0 = start();
+    for (unsigned long i = 0; i < Iterations; i++)
+    {
+        BLEMIDI.getBleClass().receive(packet, length);
+        drain();
+    }
+    auto ns = nowNs() - t0;
+
+    report(name, Iterations, Iterations * messagesPerPacket, ns, drained == Iterations * bytesPerPacket);
+}
+
+// the same, whole messages at once with readMessages()
+static void benchDecodeMessages(const char *name, byte *packet, size_t length, unsigned long messagesPerPacket)
+{
+    BLEMIDI_NAMESPACE::RxMessage messages[32];
+    unsigned long decoded = 0;
+
+    auto t0 = start();
+    for (unsigned long i = 0; i < Iterations; i++)
+    {
+        BLEMIDI.getBleClass().receive(packet, length);
+        decoded += BLEMIDI.readMessages(messages, 32);
+    }
+    auto ns = nowNs() - t0;
+
+    report(name, Iterations, Iterations * messagesPerPacket, ns, decoded == Iterations * messagesPerPacket);
+}
+
+template <class Transport>
+static void benchEncodeMixed(const char *name, Transport &transport)
+{
+    auto &backend = transport.getBleClass();
+    backend.loopback = false;
+    backend.packetsWritten = 0;
+    backend.bytesWritten = 0;
+
+    auto t0 = start();
+    for (unsigned long i = 0; i < Iterations; i++)
+    {
+        transport.beginTransmission(MIDI_NAMESPACE::NoteOn);
+        transport.write(0x90);
+        transport.write(0x3C);
+        transport.write(0x64);
+        transport.endTransmission();
+
+        transport.beginTransmission(MIDI_NAMESPACE::ControlChange);
+        transport.write(0xB0);
+        transport.write(0x07);
+        transport.write(0x40);
+        transport.endTransmission();
+
+        transport.beginTransmission(MIDI_NAMESPACE::ProgramChange);
+        transport.write(0xC0);
+        transport.write(0x05);
+        transport.endTransmission();
+    }
+    transport.flush();
+    auto ns = nowNs() - t0;
+
+    // every message is a timestamp byte + the message, every packet has a header
+    auto packets = backend.packetsWritten;
+    report(name, packets, Iterations * 3, ns, backend.bytesWritten - packets == Iterations * 11);
+
+    backend.loopback = true;
+}
+
+// Control Changes on one channel, all at the same time (a fader move)
+template <class Transport>
+static void benchEncodeControlChanges(const char *name, Transport &transport, unsigned long bytesPerMessage)
+{
+    auto &backend = transport.getBleClass();
+    backend.loopback = false;
+    backend.packetsWritten = 0;
+    backend.bytesWritten = 0;
+
+    auto t0 = start();
+    for (unsigned long i = 0; i < Iterations; i++)
+    {
+        transport.beginTransmission(MIDI_NAMESPACE::ControlChange);
+        transport.write(0xB0);
+        transport.write(0x07);
+        transport.write(i & 0x7F);
+        transport.endTransmission();
+    }
+    transport.flush();
+    auto ns = nowNs() - t0;
+
+    // the first message of every packet has its timestamp and status
+    auto packets = backend.packetsWritten;
+    report(name, packets, Iterations, ns, backend.bytesWritten - packets * (1 + 4 - bytesPerMessage) == Iterations * bytesPerMessage);
+
+    backend.loopback = true;
+}
+
+static void benchSysEx()
+{
+    const unsigned long iterations = Iterations / 50;
+
+    BLEMIDI.getBleClass().packetsWritten = 0;
+    drained = 0;
+
+    auto t0 = start();
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        // same calls as MidiInterface::sendSysEx
+        BLEMIDI.beginTransmission(MIDI_NAMESPACE::SystemExclusive);
+        for (size_t j = 0; j < sizeof(sysEx); j++)
+        {
+            BLEMIDI.write(sysEx[j]);
+            drain(); // keep up with the packets looped back
+        }
+        BLEMIDI.endTransmission();
+        drain();
+    }
+    auto ns = nowNs() - t0;
+
+    auto packets = BLEMIDI.getBleClass().packetsWritten;
+    report("encode+decode 1KB SysEx", packets, iterations, ns, drained == iterations * sizeof(sysEx));
+}
+
+void setup()
+{
+#if ARDUINO
+    Serial.begin(115200);
+    while (!Serial)
+    {
+    }
+#endif
+
+    sysEx[0] = 0xF0;
+    for (size_t i = 1; i < sizeof(sysEx) - 1; i++)
+        sysEx[i] = i & 0x7F;
+    sysEx[sizeof(sysEx) - 1] = 0xF7;
+
+    BLEMIDI.begin();
+    BLEMIDI_Coalescing.begin();
+    BLEMIDI_RunningStatus.begin();
+
+    benchDecode("decode running status", runningStatusPacket, sizeof(runningStatusPacket), 20, sizeof(runningStatusPacket) - 2);
+    benchDecode("decode mixed channel", mixedPacket, sizeof(mixedPacket), 6, 16);
+    benchDecode("decode realtime interleaved", realtimePacket, sizeof(realtimePacket), 8, 16);
+    benchDecodeMessages("decode running status, bulk", runningStatusPacket, sizeof(runningStatusPacket), 20);
+    benchDecodeMessages("decode mixed channel, bulk", mixedPacket, sizeof(mixedPacket), 6);
+    benchEncodeMixed("encode mixed channel", BLEMIDI);
+    benchEncodeMixed("encode mixed, coalesced", BLEMIDI_Coalescing);
+    benchEncodeControlChanges("encode CC, coalesced", BLEMIDI_Coalescing, 4);
+    benchEncodeControlChanges("encode CC, running status", BLEMIDI_RunningStatus, 2);
+    benchSysEx();
+}
+
+#if !ARDUINO
+static void benchCorpus(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return;
+    }
+
+    // all packets, each preceded by its length
+    static byte corpus[1 << 24];
+    size_t corpusLength = 0;
+    unsigned long corpusPackets = 0;
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) && corpusLength + 256 < sizeof(corpus))
+    {
+        size_t start = corpusLength++;
+        for (char *p = line; *p && *p != '\n';)
+        {
+            char *end;
+            corpus[corpusLength++] = strtoul(p, &end, 16);
+            if (end == p)
+                break;
+            p = end;
+        }
+        corpus[start] = corpusLength - start - 1;
+        corpusPackets++;
+    }
+    fclose(file);
+
+    drained = 0;
+    auto t0 = start();
+    for (size_t i = 0; i < corpusLength; i += corpus[i] + 1)
+    {
+        BLEMIDI.getBleClass().receive(corpus + i + 1, corpus[i]);
+        drain();
+    }
+    auto ns = nowNs() - t0;
+
+    // messages are not counted, bytes decoded instead
+    report("decode corpus (bytes/s)", corpusPackets, drained, ns, BLEMIDI.getBleClass().rxDropped == 0);
+}
+#endif
+
+void loop()
+{
+}
+
+#if !ARDUINO
+int main(int argc, char *argv[])
+{
+    setup();
+    if (argc > 1)
+        benchCorpus(argv[1]);
+    return 0;
+}
+#endif
@@ -0,0 +1,416 @@
+/**
+ * --------------------------------------------------------
+ * Differential fuzzing of the BLE-MIDI packet decoder (BLEMIDI_Transport::receive),
+ * using the loopback backend to capture the decoded bytes.
+ *
+ * Every packet is also decoded by a small reference decoder, written from the
+ * specification text (see the comments in BLEMIDI_Transport.h). When the reference
+ * finds the packet valid, both outputs must be identical. Invalid packets must
+ * just not crash (or read out of bounds, run with sanitizers).
+ *
+ * Standalone: generates (mostly) valid packets, mutates some of them, and writes
+ * the valid ones to a corpus file, to be used as input of Loopback_Benchmark:
+ *
+ *   g++ -std=c++11 -g -O1 -fsanitize=address,undefined -x c++ Loopback_Fuzz.ino \
+ *       -I../../src -I<path to arduino_midi_library>/src -o fuzz && ./fuzz corpus.txt
+ *
+ * libFuzzer:
+ *
+ *   clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address,undefined -DBLEMIDI_LIBFUZZER -x c++ Loopback_Fuzz.ino \
+ *       -I../../src -I<path to arduino_midi_library>/src -o fuzz && ./fuzz
+ *
+ * On a board, the standalone generator runs and the result is printed on Serial.
+ * --------------------------------------------------------
+ */
+
+#include <BLEMIDI_Transport.h>
+
+#include <hardware/BLEMIDI_Loopback.h>
+
+#if !ARDUINO
+#include <stdio.h>
+#include <stdlib.h>
+#endif
+
+struct FuzzSettings : public BLEMIDI_NAMESPACE::DefaultSettings
+{
+    static const short RxRingBufferSize = 1024; // room for the decoded bytes of any packet
+};
+
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Loopback-Fuzz", MIDI, FuzzSettings)
+
+// the same, with runningStatus expanded to full MIDI messages
+struct ExpandedSettings : public FuzzSettings
+{
+    static const bool RxRunningStatus = false;
+};
+
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Loopback-Fuzz-Expanded", MIDI_Expanded, ExpandedSettings)
+
+static const size_t MaxPacketSize = 128;
+
+// ====================================================================================
+// Reference decoder, straight from the spec. Returns false if the packet is not valid.
+// ====================================================================================
+
+struct Output
+{
+    byte data[4 * MaxPacketSize];
+    size_t length = 0;
+
+    void add(byte value) { data[length++] = value; }
+};
+
+static size_t referenceDataLength(byte status)
+{
+    switch (status & 0xF0)
+    {
+    case 0xC0: // Program Change
+    case 0xD0: // Channel Pressure
+        return 1;
+    case 0xF0:
+        switch (status)
+        {
+        case 0xF1: // MTC Quarter Frame
+        case 0xF3: // Song Select
+            return 1;
+        case 0xF2: // Song Position Pointer
+            return 2;
+        default:
+            return 0;
+        }
+    default:
+        return 2;
+    }
+}
+
+static bool isData(byte value) { return value < 0x80; }
+
+static bool referenceDecode(const byte *packet, size_t length, bool passRunningStatus, Output &out)
+{
+    // The first byte of all BLE packets must be a header byte (bit 7 set)
+    if (length < 2 || isData(packet[0]))
+        return false;
+
+    size_t i = 1;
+    bool inSysEx = false;
+    byte runningStatus = 0; // the end of a BLE packet does cancel Running Status
+
+    // SysEx continued from the previous packet: no timestamp byte
+    if (isData(packet[i]))
+    {
+        inSysEx = true;
+        while (i < length && isData(packet[i]))
+            out.add(packet[i++]);
+    }
+
+    while (i < length)
+    {
+        // Every MIDI Status byte must be preceded by a timestamp byte
+        if (isData(packet[i++]))
+            return false;
+        if (i >= length)
+            return false; // timestamp without a message
+
+        byte status = packet[i];
+        bool timestamped = true;
+
+        if (isData(status))
+        {
+            // Running Status, only after a full channel message in this packet
+            if (inSysEx || runningStatus == 0)
+                return false;
+            status = runningStatus;
+        }
+        else
+            i++;
+
+        if (inSysEx)
+        {
+            if (status == 0xF7)
+            {
+                out.add(status);
+                inSysEx = false;
+                continue;
+            }
+            if (status < 0xF8)
+                return false; // only System Real-Time can be interleaved with a SysEx
+
+            // realtime, after which the SysEx continues
+            out.add(status);
+            while (i < length && isData(packet[i]))
+                out.add(packet[i++]);
+            continue;
+        }
+
+        if (status == 0xF7)
+            return false; // SysEx end, without SysEx
+
+        if (status == 0xF0)
+        {
+            inSysEx = true;
+            out.add(status);
+            while (i < length && isData(packet[i]))
+                out.add(packet[i++]);
+            continue; // ended by F7, or continued in the next packet
+        }
+
+        // one or more messages of this status (Running Status without timestamp byte)
+        auto dataLength = referenceDataLength(status);
+        if (status < 0xF0)
+            runningStatus = status; // System Common and Real-Time do not cancel Running Status
+
+        do
+        {
+            if (i + dataLength > length)
+                return false;
+            for (size_t j = 0; j < dataLength; j++)
+                if (!isData(packet[i + j]))
+                    return false;
+
+            // passed on as received: the status is only repeated after a timestamp byte
+            if (timestamped || !passRunningStatus)
+                out.add(status);
+            for (size_t j = 0; j < dataLength; j++)
+                out.add(packet[i++]);
+
+            timestamped = false;
+        } while (status < 0xF0 && i < length && isData(packet[i]));
+
+        if (i < length && isData(packet[i]))
+            return false; // data bytes left over
+    }
+
+    return true; // an unterminated SysEx continues in the next packet
+}
+
+// ====================================================================================
+// Run one packet through both decoders
+// ====================================================================================
+
+unsigned long packetsTested = 0;
+unsigned long packetsValid = 0;
+unsigned long mismatches = 0;
+
+// returns whether the packet is valid
+template <class Transport>
+static bool check(Transport &transport, byte *packet, size_t length, bool passRunningStatus)
+{
+    Output reference;
+    bool valid = referenceDecode(packet, length, passRunningStatus, reference);
+
+    transport.getBleClass().receive(packet, length);
+
+    Output decoded;
+    while (transport.available())
+        decoded.add(transport.read());
+
+    bool same = (decoded.length == reference.length) && memcmp(decoded.data, reference.data, decoded.length) == 0;
+
+    if (valid && !same)
+    {
+        mismatches++;
+#if !ARDUINO
+        fprintf(stderr, "mismatch (%s), packet:", passRunningStatus ? "runningStatus" : "expanded");
+        for (size_t i = 0; i < length; i++)
+            fprintf(stderr, " %02x", packet[i]);
+        fprintf(stderr, "\n");
+#endif
+    }
+    return valid;
+}
+
+static bool fuzzOne(const byte *data, size_t length)
+{
+    if (length > MaxPacketSize)
+        return false;
+
+    // exact size copy, so the sanitizers catch reads past the end
+#if ARDUINO
+    byte packet[MaxPacketSize];
+#else
+    byte *packet = (byte *)malloc(length ? length : 1);
+#endif
+    memcpy(packet, data, length);
+
+    // both ways of receiving runningStatus, see _Settings::RxRunningStatus
+    bool valid = check(BLEMIDI, packet, length, FuzzSettings::RxRunningStatus);
+    check(BLEMIDI_Expanded, packet, length, ExpandedSettings::RxRunningStatus);
+
+    packetsTested++;
+    if (valid)
+        packetsValid++;
+
+#if !ARDUINO
+    free(packet);
+#endif
+    return valid;
+}
+
+#ifdef BLEMIDI_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bool begun = false;
+    if (!begun)
+    {
+        BLEMIDI.begin();
+        BLEMIDI_Expanded.begin();
+        begun = true;
+    }
+
+    fuzzOne(data, size);
+    if (mismatches > 0)
+        abort();
+    return 0;
+}
+
+#else
+
+// ====================================================================================
+// Standalone: generator of (mostly) valid packets
+// ====================================================================================
+
+static unsigned long seed = 1;
+
+static byte nextRandom(byte range)
+{
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 16) & 0x7FFF) % range;
+}
+
+static size_t generate(byte *packet)
+{
+    size_t length = 0;
+    byte timestampLow = nextRandom(128);
+
+    packet[length++] = 0x80 | nextRandom(64);
+
+    byte runningStatus = 0;
+    byte messages = 1 + nextRandom(8);
+    for (byte m = 0; m < messages && length < MaxPacketSize - 16; m++)
+    {
+        byte kind = nextRandom(10);
+
+        if (runningStatus && kind < 3)
+        {
+            if (nextRandom(2))
+                packet[length++] = 0x80 | timestampLow;
+            for (size_t j = 0; j < referenceDataLength(runningStatus); j++)
+                packet[length++] = nextRandom(128);
+            continue;
+        }
+
+        packet[length++] = 0x80 | timestampLow;
+
+        if (kind < 7)
+        {
+            byte status = 0x80 | (nextRandom(7) << 4) | nextRandom(16);
+            packet[length++] = status;
+            for (size_t j = 0; j < referenceDataLength(status); j++)
+                packet[length++] = nextRandom(128);
+            runningStatus = status;
+        }
+        else if (kind < 8)
+        {
+            static const byte common[] = {0xF1, 0xF2, 0xF3, 0xF6};
+            byte status = common[nextRandom(4)];
+            packet[length++] = status;
+            for (size_t j = 0; j < referenceDataLength(status); j++)
+                packet[length++] = nextRandom(128);
+        }
+        else if (kind < 9)
+        {
+            packet[length++] = 0xF8 + nextRandom(8);
+        }
+        else
+        {
+            packet[length++] = 0xF0;
+            for (byte j = nextRandom(8); j > 0; j--)
+                packet[length++] = nextRandom(128);
+            packet[length++] = 0x80 | timestampLow;
+            packet[length++] = 0xF7;
+        }
+
+        // timestamps increase, wrapping at most once per packet
+        timestampLow = (timestampLow + nextRandom(4)) & 0x7F;
+    }
+
+    // mutate
+    if (nextRandom(4) == 0)
+        packet[nextRandom(length)] = nextRandom(255) + 1;
+    if (nextRandom(8) == 0)
+        length = nextRandom(length + 1);
+
+    return length;
+}
+
+#if !ARDUINO
+static FILE *corpus = nullptr;
+#endif
+
+static const unsigned long Iterations =
+#if ARDUINO
+    10000;
+#else
+    2000000;
+#endif
+
+void setup()
+{
+#if ARDUINO
+    Serial.begin(115200);
+    while (!Serial)
+    {
+    }
+#endif
+
+    BLEMIDI.begin();
+    BLEMIDI_Expanded.begin();
+
+    byte packet[MaxPacketSize];
+    for (unsigned long i = 0; i < Iterations; i++)
+    {
+        auto length = generate(packet);
+        bool valid = fuzzOne(packet, length);
+
+#if !ARDUINO
+        // one packet per line, in hex
+        if (valid && corpus && length > 0)
+        {
+            for (size_t j = 0; j < length; j++)
+                fprintf(corpus, j ? " %02x" : "%02x", packet[j]);
+            fprintf(corpus, "\n");
+        }
+#endif
+    }
+
+    char line[96];
+    snprintf(line, sizeof(line), "%lu packets, %lu valid, %lu mismatches, %lu dropped",
+             packetsTested, packetsValid, mismatches, (unsigned long)BLEMIDI.getBleClass().rxDropped);
+#if ARDUINO
+    Serial.println(line);
+#else
+    puts(line);
+#endif
+}
+
+void loop()
+{
+}
+
+#if !ARDUINO
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        corpus = fopen(argv[1], "w");
+
+    setup();
+
+    if (corpus)
+        fclose(corpus);
+    return mismatches ? 1 : 0;
+}
+#endif
+
+#endif
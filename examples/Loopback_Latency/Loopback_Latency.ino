@@ -0,0 +1,149 @@
+/**
+ * --------------------------------------------------------
+ * Latency of the transport over a simulated BLE link: two loopback instances, linked to
+ * each other, deliver their packets at connection events only (every connectionInterval ms).
+ * One instance sends latency probes, the other one echoes them (UseLatencyProbe).
+ * Reports the round trip and the one-way estimate per connection interval, with and
+ * without TX coalescing, in ms. Run it before and after a change to the TX/RX paths.
+ *
+ * Runs on a board (in real time, results are printed on Serial), or natively on a PC
+ * (on the virtual millis() clock, so it takes no time):
+ *
+ *   g++ -std=c++11 -O2 -x c++ Loopback_Latency.ino \
+ *       -I../../src -I<path to arduino_midi_library>/src -o latency && ./latency
+ * --------------------------------------------------------
+ */
+
+#include <BLEMIDI_Transport.h>
+
+#include <hardware/BLEMIDI_Loopback.h>
+
+#if !ARDUINO
+#include <stdio.h>
+#endif
+
+struct ProbeSettings : public BLEMIDI_NAMESPACE::DefaultSettings
+{
+    static const bool UseLatencyProbe = true;
+};
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Prober", MIDI_Prober, ProbeSettings)
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Echo", MIDI_Echo, ProbeSettings)
+
+struct CoalescingProbeSettings : public ProbeSettings
+{
+    static const bool UseTxCoalescing = true;
+};
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Prober-Coalescing", MIDI_ProberCoalescing, CoalescingProbeSettings)
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Echo-Coalescing", MIDI_EchoCoalescing, CoalescingProbeSettings)
+
+static const unsigned long Probes = 200;
+static const unsigned long ProbeInterval = 97; // ms, not in step with the connection interval
+
+static void advance()
+{
+#if ARDUINO
+    delay(1);
+#else
+    BLEMIDI_NAMESPACE::hostMillis()++;
+#endif
+}
+
+template <class Transport>
+static void drain(Transport &transport)
+{
+    BLEMIDI_NAMESPACE::RxMessage messages[8];
+    while (transport.readMessages(messages, 8))
+    {
+    }
+}
+
+// time (ms) below which the given share (%) of the one-way estimates fall
+template <class Probe>
+static unsigned long oneWayPercentile(const Probe &probe, unsigned percent)
+{
+    unsigned long total = 0;
+    for (unsigned i = 0; i < ProbeSettings::LatencyProbeBuckets; i++)
+        total += probe.oneWay(i);
+
+    unsigned long sum = 0;
+    for (unsigned i = 0; i < ProbeSettings::LatencyProbeBuckets; i++)
+    {
+        sum += probe.oneWay(i);
+        if (total && sum * 100 >= total * percent)
+            return (i + 1) * ProbeSettings::LatencyProbeBucketWidth / 1000;
+    }
+    return 0;
+}
+
+template <class Transport>
+static void measure(const char *name, Transport &prober, Transport &echo, unsigned interval)
+{
+    prober.getBleClass().peer = &echo.getBleClass();
+    echo.getBleClass().peer = &prober.getBleClass();
+    prober.getBleClass().connectionInterval = interval;
+    echo.getBleClass().connectionInterval = interval;
+
+    auto &probe = prober.getLatencyProbe();
+    probe.reset();
+
+    for (unsigned long t = 0; t < Probes * ProbeInterval; t++)
+    {
+        if (t % ProbeInterval == 0)
+            prober.sendLatencyProbe();
+
+        advance();
+        drain(prober);
+        drain(echo);
+    }
+
+    char line[128];
+    snprintf(line, sizeof(line), "%-12s %3u ms   round trip %4lu %4lu %4lu   one way p50 %3lu p95 %3lu   %lu/%lu",
+             name, interval,
+             probe.minRoundTrip() / 1000, probe.meanRoundTrip() / 1000, probe.maxRoundTrip() / 1000,
+             oneWayPercentile(probe, 50), oneWayPercentile(probe, 95),
+             probe.echoesReceived(), probe.pingsSent());
+#if ARDUINO
+    Serial.println(line);
+#else
+    puts(line);
+#endif
+}
+
+void setup()
+{
+#if ARDUINO
+    Serial.begin(115200);
+    while (!Serial)
+    {
+    }
+#endif
+
+    BLEMIDI_Prober.begin();
+    BLEMIDI_Echo.begin();
+    BLEMIDI_ProberCoalescing.begin();
+    BLEMIDI_EchoCoalescing.begin();
+
+#if ARDUINO
+    Serial.println("interval     (min mean max, ms)");
+#else
+    puts("interval     (min mean max, ms)");
+#endif
+
+    static const unsigned intervals[] = {8, 15, 30, 45};
+    for (auto interval : intervals)
+        measure("direct", BLEMIDI_Prober, BLEMIDI_Echo, interval);
+    for (auto interval : intervals)
+        measure("coalescing", BLEMIDI_ProberCoalescing, BLEMIDI_EchoCoalescing, interval);
+}
+
+void loop()
+{
+}
+
+#if !ARDUINO
+int main()
+{
+    setup();
+    return 0;
+}
+#endif
@@ -0,0 +1,62 @@
+#include <BLEMIDI_Transport.h>
+
+#include <hardware/BLEMIDI_ESP32_NimBLE.h>
+
+#ifndef LED_BUILTIN
+#define LED_BUILTIN 2
+#endif
+
+// Up to 3 centrals (iPads, computers, ...) connected at the same time
+struct MultiSettings : public BLEMIDI_NAMESPACE::DefaultSettings
+{
+  static const unsigned short MaxConnections = 3;
+};
+
+BLEMIDI_CREATE_CUSTOM_INSTANCE("Esp32-Multi-MIDI", MIDI, MultiSettings)
+
+unsigned long t0 = millis();
+
+// -----------------------------------------------------------------------------
+// Every incoming NoteOn is answered to the central that sent it,
+// a Timing Clock is sent to all of them.
+// -----------------------------------------------------------------------------
+void setup()
+{
+  MIDI.begin();
+
+  pinMode(LED_BUILTIN, OUTPUT);
+  digitalWrite(LED_BUILTIN, LOW);
+
+  BLEMIDI.setHandleConnected([]() {
+    digitalWrite(LED_BUILTIN, HIGH);
+  });
+
+  BLEMIDI.setHandleDisconnected([]() {
+    if (BLEMIDI.getBleClass().connectionCount() == 0)
+      digitalWrite(LED_BUILTIN, LOW);
+  });
+
+  MIDI.setHandleNoteOn([](byte channel, byte note, byte velocity) {
+    auto &ble = BLEMIDI.getBleClass();
+
+    // reply to the sender only
+    ble.setTxConnection(ble.getRxConnection());
+    MIDI.sendNoteOff(note, 0, channel);
+    ble.setTxConnection(ble.AllConnections);
+  });
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+void loop()
+{
+  MIDI.read();
+
+  if (BLEMIDI.getBleClass().connectionCount() > 0 && (millis() - t0) > 500)
+  {
+    t0 = millis();
+
+    MIDI.sendRealTime(MIDI_NAMESPACE::Clock); // to all centrals
+  }
+}
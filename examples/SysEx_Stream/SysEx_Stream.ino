@@ -0,0 +1,103 @@
+#include <BLEMIDI_Transport.h>
+
+#include <hardware/BLEMIDI_ESP32_NimBLE.h>
+//#include <hardware/BLEMIDI_ESP32.h>
+//#include <hardware/BLEMIDI_ArduinoBLE.h>
+
+#ifndef LED_BUILTIN
+#define LED_BUILTIN 2
+#endif
+
+BLEMIDI_CREATE_DEFAULT_INSTANCE()
+
+// A large SysEx that does not need to be in RAM: here it is generated on the fly,
+// it could as well come from flash or a file.
+const size_t dumpSize = 16 * 1024;
+size_t dumpPosition = 0;
+
+unsigned long t0 = millis();
+bool isConnected = false;
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+void setup()
+{
+  Serial.begin(115200);
+
+  pinMode(LED_BUILTIN, OUTPUT);
+  digitalWrite(LED_BUILTIN, LOW);
+
+  BLEMIDI.setHandleConnected(OnConnected);
+  BLEMIDI.setHandleDisconnected(OnDisconnected);
+
+  MIDI.begin();
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+void loop()
+{
+  // Listen to incoming notes, and advance the SysEx stream
+  MIDI.read();
+
+  if (isConnected && !BLEMIDI.isSysExStreaming() && (millis() - t0) > 10000)
+  {
+    t0 = millis();
+
+    dumpPosition = 0;
+    BLEMIDI.sendSysExStream(OnSysExData, OnSysExProgress);
+  }
+}
+
+// ====================================================================================
+// SysEx stream
+// ====================================================================================
+
+// -----------------------------------------------------------------------------
+// Fill the buffer with the next bytes of the dump (without F0 and F7),
+// return the number of bytes, 0 when done
+// -----------------------------------------------------------------------------
+size_t OnSysExData(byte *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length && dumpPosition < dumpSize)
+    buffer[count++] = dumpPosition++ & 0x7F;
+  return count;
+}
+
+// -----------------------------------------------------------------------------
+//
+// -----------------------------------------------------------------------------
+void OnSysExProgress(size_t bytesSent, bool done)
+{
+  if (done)
+  {
+    Serial.print("SysEx sent: ");
+    Serial.print(bytesSent);
+    Serial.print(" bytes in ");
+    Serial.print(millis() - t0);
+    Serial.println(" ms");
+  }
+}
+
+// ====================================================================================
+// Event handlers for incoming MIDI messages
+// ====================================================================================
+
+// -----------------------------------------------------------------------------
+// Device connected
+// -----------------------------------------------------------------------------
+void OnConnected() {
+  isConnected = true;
+  digitalWrite(LED_BUILTIN, HIGH);
+}
+
+// -----------------------------------------------------------------------------
+// Device disconnected
+// -----------------------------------------------------------------------------
+void OnDisconnected() {
+  isConnected = false;
+  digitalWrite(LED_BUILTIN, LOW);
+}
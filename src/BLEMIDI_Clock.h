@@ -0,0 +1,55 @@
+#pragma once
+
+#include "BLEMIDI_Defs.h"
+
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#endif
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Clocks for the BLE-MIDI timestamps (see _Settings::TimestampClock).
+
+ A clock is a class with a static now(), the time in ms. Only the lower 13 bits go into a
+ timestamp, so now() may wrap at any multiple of 8192 ms (unsigned long does).
+ Any class of the application with the same member can be used as well.
+ */
+
+// millis(), the default
+struct MillisClock
+{
+    static unsigned long now()
+    {
+        return millis();
+    }
+};
+
+#ifdef ESP_PLATFORM
+// the 64-bit microsecond timer of the ESP32, rounded to the nearest ms:
+// not tied to the FreeRTOS tick like millis() can be
+struct EspTimerClock
+{
+    static unsigned long now()
+    {
+        return (unsigned long)((esp_timer_get_time() + 500) / 1000);
+    }
+};
+#endif
+
+// set and advanced by the application, e.g. for deterministic tests across the 8191 ms wrap
+struct VirtualClock
+{
+    static unsigned long &time()
+    {
+        static unsigned long now = 0;
+        return now;
+    }
+
+    static unsigned long now()
+    {
+        return time();
+    }
+};
+
+END_BLEMIDI_NAMESPACE
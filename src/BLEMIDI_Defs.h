@@ -6,5 +6,28 @@
 #include <Arduino.h>
 #else
 #include <inttypes.h>
+#include <string.h>
 typedef uint8_t byte;
+
+// No Arduino core (host builds, see hardware/BLEMIDI_Loopback.h):
+// millis() is a virtual clock that is advanced by the application.
+BEGIN_BLEMIDI_NAMESPACE
+
+inline unsigned long &hostMillis()
+{
+    static unsigned long now = 0;
+    return now;
+}
+
+END_BLEMIDI_NAMESPACE
+
+inline unsigned long millis()
+{
+    return BLEMIDI_NAMESPACE::hostMillis();
+}
+
+inline unsigned long micros()
+{
+    return millis() * 1000;
+}
 #endif
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "BLEMIDI_Defs.h"
+#include "BLEMIDI_RingBuffer.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Round-trip latency probe (see _Settings::UseLatencyProbe).
+
+ A probe is a SysEx with the non-commercial manufacturer ID:
+   F0 7D 'L' kind sequence t0 t1 t2 t3 F7
+ kind is Ping or Echo, t0..t3 the micros() of the prober when the ping was sent (28 bits, 7 per byte).
+ The peer sends a ping back unchanged, as Echo. The round trip is measured on the prober's clock.
+ The one-way time is estimated from the BLE-MIDI timestamp of the echo (the peer's clock):
+ (receive time - timestamp) is transit time + clock offset, the smallest one seen is taken as
+ half the fastest round trip, anything on top of it is added to that.
+
+ Probes are taken out by the decoder (BLE task), echoes are sent from the loop task.
+ */
+template <class _Settings, bool enabled = _Settings::UseLatencyProbe>
+class BLEMIDI_LatencyProbe
+{
+public:
+    enum Kind : byte
+    {
+        Ping = 1,
+        Echo = 2,
+    };
+
+    static const size_t Length = 8; // payload, between F0 and F7
+
+private:
+    static const unsigned long TimeMask = 0x0FFFFFFF; // 28 bits of micros()
+
+    struct Payload
+    {
+        byte data[Length];
+    };
+
+    // pings of the peer, from the BLE task to the loop task
+    SpscRingBuffer<Payload, 4> mEchoes;
+
+    byte mSequence = 0;
+    unsigned long mLastPing = 0;
+
+    unsigned long mPingsSent = 0;
+    unsigned long mEchoesReceived = 0;
+    unsigned long mPingsEchoed = 0;
+
+    unsigned long mRoundTrip[_Settings::LatencyProbeBuckets];
+    unsigned long mOneWay[_Settings::LatencyProbeBuckets];
+    unsigned long mMinRoundTrip;
+    unsigned long mMaxRoundTrip;
+    unsigned long mSumRoundTrip;
+
+    uint16_t mMinTransit = 0; // (receive time - sender timestamp), 13 bits
+    bool mHaveTransit = false;
+
+public:
+    BLEMIDI_LatencyProbe()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (auto &count : mRoundTrip)
+            count = 0;
+        for (auto &count : mOneWay)
+            count = 0;
+        mMinRoundTrip = TimeMask;
+        mMaxRoundTrip = 0;
+        mSumRoundTrip = 0;
+        mPingsSent = mEchoesReceived = mPingsEchoed = 0;
+        mHaveTransit = false;
+    }
+
+    // histograms, LatencyProbeBucketWidth us per bucket, the last one also counts all longer times
+    unsigned long roundTrip(unsigned bucket) const { return mRoundTrip[bucket]; }
+    unsigned long oneWay(unsigned bucket) const { return mOneWay[bucket]; }
+
+    // in us
+    unsigned long minRoundTrip() const { return mEchoesReceived ? mMinRoundTrip : 0; }
+    unsigned long maxRoundTrip() const { return mMaxRoundTrip; }
+    unsigned long meanRoundTrip() const { return mEchoesReceived ? mSumRoundTrip / mEchoesReceived : 0; }
+
+    unsigned long pingsSent() const { return mPingsSent; }
+    unsigned long echoesReceived() const { return mEchoesReceived; }
+    unsigned long pingsEchoed() const { return mPingsEchoed; }
+
+    // loop task: payload of a new ping
+    bool ping(byte *payload)
+    {
+        unsigned long now = micros() & TimeMask;
+
+        payload[0] = 0x7D; // non-commercial
+        payload[1] = 'L';
+        payload[2] = Ping;
+        payload[3] = mSequence++ & 0x7F;
+        for (size_t i = 0; i < 4; i++)
+            payload[4 + i] = (now >> (7 * i)) & 0x7F;
+
+        mLastPing = millis();
+        mPingsSent++;
+        return true;
+    }
+
+    // loop task: time for the next ping (LatencyProbeInterval)
+    bool due()
+    {
+        return _Settings::LatencyProbeInterval > 0 && millis() - mLastPing >= _Settings::LatencyProbeInterval;
+    }
+
+    // loop task: payload of the next echo to send
+    bool echo(byte *payload)
+    {
+        Payload pending;
+        if (!mEchoes.pop(pending))
+            return false;
+
+        memcpy(payload, pending.data, Length);
+        payload[2] = Echo;
+        mPingsEchoed++;
+        return true;
+    }
+
+    // BLE task: at buffer[i], after F0. A probe (payload, timestamp byte, F7) is taken out, i moves past it
+    bool receive(const byte *buffer, size_t length, size_t &i, uint16_t senderTimestamp)
+    {
+        // payload, timestamp byte (bit 7 set), F7
+        if (i + Length + 2 > length || buffer[i] != 0x7D || buffer[i + 1] != 'L' ||
+            buffer[i + Length] < 0x80 || buffer[i + Length + 1] != 0xF7)
+            return false;
+
+        auto payload = &buffer[i];
+        for (size_t j = 2; j < Length; j++)
+            if (payload[j] >= 0x80)
+                return false;
+
+        if (payload[2] == Ping)
+        {
+            Payload pending;
+            memcpy(pending.data, payload, Length);
+            if (mEchoes.push(pending)) // or dropped, when the loop task does not keep up
+                mEchoes.commit();
+        }
+        else if (payload[2] == Echo)
+            measure(payload, senderTimestamp);
+        else
+            return false;
+
+        i += Length + 2;
+        return true;
+    }
+
+protected:
+    void measure(const byte *payload, uint16_t senderTimestamp)
+    {
+        unsigned long sent = 0;
+        for (size_t i = 0; i < 4; i++)
+            sent |= (unsigned long)payload[4 + i] << (7 * i);
+
+        unsigned long roundTrip = (micros() - sent) & TimeMask;
+
+        mEchoesReceived++;
+        mSumRoundTrip += roundTrip;
+        if (roundTrip < mMinRoundTrip)
+            mMinRoundTrip = roundTrip;
+        if (roundTrip > mMaxRoundTrip)
+            mMaxRoundTrip = roundTrip;
+        count(mRoundTrip, roundTrip);
+
+        // one way, from the timestamp the peer put on the echo
+        uint16_t transit = ((uint16_t)_Settings::TimestampClock::now() - senderTimestamp) & 0x1FFF;
+        if (!mHaveTransit || transit < mMinTransit)
+        {
+            mMinTransit = transit;
+            mHaveTransit = true;
+        }
+        count(mOneWay, mMinRoundTrip / 2 + (unsigned long)(transit - mMinTransit) * 1000);
+    }
+
+    static void count(unsigned long *histogram, unsigned long us)
+    {
+        unsigned long bucket = us / _Settings::LatencyProbeBucketWidth;
+        if (bucket >= _Settings::LatencyProbeBuckets)
+            bucket = _Settings::LatencyProbeBuckets - 1;
+        histogram[bucket]++;
+    }
+};
+
+// disabled, compiles to nothing
+template <class _Settings>
+class BLEMIDI_LatencyProbe<_Settings, false>
+{
+public:
+    static const size_t Length = 8;
+
+    void reset() {}
+    unsigned long roundTrip(unsigned) const { return 0; }
+    unsigned long oneWay(unsigned) const { return 0; }
+    unsigned long minRoundTrip() const { return 0; }
+    unsigned long maxRoundTrip() const { return 0; }
+    unsigned long meanRoundTrip() const { return 0; }
+    unsigned long pingsSent() const { return 0; }
+    unsigned long echoesReceived() const { return 0; }
+    unsigned long pingsEchoed() const { return 0; }
+    bool ping(byte *) { return false; }
+    bool due() { return false; }
+    bool echo(byte *) { return false; }
+    bool receive(const byte *, size_t, size_t &, uint16_t) { return false; }
+};
+
+END_BLEMIDI_NAMESPACE
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "BLEMIDI_Defs.h"
+#include "BLEMIDI_RingBuffer.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Receiver side jitter buffer (see _Settings::UsePlayout).
+
+ All messages in a BLE packet arrive at the same time, the connection interval shows up as
+ jitter. The BLE-MIDI timestamps tell when each message was sent, in the sender's 13-bit clock.
+ The difference between our clock and the sender's timestamp is transit time + clock offset.
+ The smallest difference seen is taken as reference (the fastest possible transit); a message
+ that arrives later than that is held back by the difference, plus PlayoutLatency for all.
+ So every message is played out PlayoutLatency ms after the fastest transit, as long as
+ it did not arrive later than that (then it is played out immediately).
+
+ The decoded bytes are stored with their due time, the BLE task adds them, the loop task
+ takes them out (available) when due, in order.
+ */
+template <class _Settings, bool enabled = _Settings::UsePlayout>
+class BLEMIDI_Playout
+{
+private:
+    struct Entry
+    {
+        uint16_t due; // TimestampClock, lower 16 bits
+        byte value;
+    };
+
+    SpscRingBuffer<Entry, _Settings::PlayoutBufferSize> mBuffer;
+
+    uint16_t mDue = 0;
+
+    uint16_t mOffset = 0;     // smallest (receive time - send time), 13 bits
+    uint16_t mOffsetTime = 0; // when mOffset was last adjusted
+    bool mSynced = false;
+
+public:
+    // start of a message, with its (wrap corrected) 13-bit timestamp
+    void timestamp(uint16_t senderTimestamp)
+    {
+        uint16_t now = _Settings::TimestampClock::now();
+        uint16_t delta = (now - senderTimestamp) & 0x1FFF;
+        uint16_t late = (delta - mOffset) & 0x1FFF;
+
+        if (!mSynced || late >= 0x1000 || late > 1000)
+        {
+            // first message, faster than the reference, or the sender's clock jumped
+            mOffset = delta;
+            mOffsetTime = now;
+            mSynced = true;
+            late = 0;
+        }
+        else if ((uint16_t)(now - mOffsetTime) >= 1000)
+        {
+            // slowly follow the drift between both clocks
+            mOffset = (mOffset + 1) & 0x1FFF;
+            mOffsetTime = now;
+        }
+
+        mDue = (late >= _Settings::PlayoutLatency) ? now : now + _Settings::PlayoutLatency - late;
+    }
+
+    // continuation of a SysEx, no timestamp: keep the order, nothing more
+    void continuation()
+    {
+        mDue = _Settings::TimestampClock::now();
+    }
+
+    // false when full, see _Settings::RxOverflow
+    bool add(byte value)
+    {
+        Entry entry = {mDue, value};
+        return mBuffer.push(entry);
+    }
+
+    size_t space()
+    {
+        return mBuffer.space();
+    }
+
+    void commit()
+    {
+        mBuffer.commit();
+    }
+
+    bool available(byte *value)
+    {
+        Entry entry;
+        if (!mBuffer.peek(entry))
+            return false;
+
+        if ((int16_t)((uint16_t)_Settings::TimestampClock::now() - entry.due) < 0)
+            return false; // not yet
+
+        mBuffer.pop(entry);
+        *value = entry.value;
+        return true;
+    }
+
+    void reset()
+    {
+        mSynced = false;
+    }
+};
+
+// disabled, compiles to nothing
+template <class _Settings>
+class BLEMIDI_Playout<_Settings, false>
+{
+public:
+    void timestamp(uint16_t) {}
+    void continuation() {}
+    bool add(byte) { return false; }
+    size_t space() { return 0; }
+    void commit() {}
+    bool available(byte *) { return false; }
+    void reset() {}
+};
+
+END_BLEMIDI_NAMESPACE
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "BLEMIDI_Namespace.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Lock-free single-producer/single-consumer ring buffer.
+
+ The producer (the BLE host task) pushes the decoded bytes of a whole packet
+ and publishes them in one go with commit(). The consumer (the loop task)
+ pops from a snapshot of the published index, and only hands the consumed
+ slots back to the producer when that snapshot is exhausted.
+ That way there is one atomic store per packet on the producer side and one
+ atomic load/store per burst on the consumer side, instead of a critical
+ section for every byte.
+
+ Exactly one task may call push/commit, and exactly one task may call peek/pop.
+
+ Uses the GCC __atomic builtins rather than <atomic>, not all cores ship the latter (AVR).
+ */
+template <typename T, size_t rawSize>
+class SpscRingBuffer
+{
+    static_assert(rawSize > 0 && (rawSize & (rawSize - 1)) == 0, "rawSize must be a power of 2");
+
+public:
+    SpscRingBuffer()
+    {
+    }
+
+    // Producer side
+
+    bool push(const T &element)
+    {
+        if (mWriteIndex - mCachedReadIndex >= rawSize)
+        {
+            mCachedReadIndex = __atomic_load_n(&mReadIndex, __ATOMIC_ACQUIRE);
+            if (mWriteIndex - mCachedReadIndex >= rawSize)
+                return false; // full
+        }
+
+        mRaw[mWriteIndex++ & (rawSize - 1)] = element;
+        return true;
+    }
+
+    // the next free element, to be filled in place and pushed with advance() (nullptr when full),
+    // saves the copy of a large element
+    T *reserve()
+    {
+        if (mWriteIndex - mCachedReadIndex >= rawSize)
+        {
+            mCachedReadIndex = __atomic_load_n(&mReadIndex, __ATOMIC_ACQUIRE);
+            if (mWriteIndex - mCachedReadIndex >= rawSize)
+                return nullptr; // full
+        }
+
+        return &mRaw[mWriteIndex & (rawSize - 1)];
+    }
+
+    void advance()
+    {
+        mWriteIndex++;
+    }
+
+    // make everything pushed since the last commit visible to the consumer
+    void commit()
+    {
+        __atomic_store_n(&mCommittedIndex, mWriteIndex, __ATOMIC_RELEASE);
+    }
+
+    // elements not handed back by the consumer yet (a little more than are really waiting,
+    // the consumer hands them back in bulk), e.g. for a high-water mark
+    size_t used()
+    {
+        mCachedReadIndex = __atomic_load_n(&mReadIndex, __ATOMIC_ACQUIRE);
+        return mWriteIndex - mCachedReadIndex;
+    }
+
+    // how many elements can be pushed now
+    size_t space()
+    {
+        return rawSize - used();
+    }
+
+    // Consumer side
+
+    bool peek(T &element)
+    {
+        if (mLocalReadIndex == mCachedCommittedIndex)
+        {
+            // give the consumed slots back to the producer, in bulk
+            __atomic_store_n(&mReadIndex, mLocalReadIndex, __ATOMIC_RELEASE);
+
+            mCachedCommittedIndex = __atomic_load_n(&mCommittedIndex, __ATOMIC_ACQUIRE);
+            if (mLocalReadIndex == mCachedCommittedIndex)
+                return false; // empty
+        }
+
+        element = mRaw[mLocalReadIndex & (rawSize - 1)];
+        return true;
+    }
+
+    bool pop(T &element)
+    {
+        if (!peek(element))
+            return false;
+
+        mLocalReadIndex++;
+        return true;
+    }
+
+    // hand the consumed slots back to the producer now, rather than in bulk
+    void release()
+    {
+        __atomic_store_n(&mReadIndex, mLocalReadIndex, __ATOMIC_RELEASE);
+    }
+
+    // drop everything, only safe when neither side is running
+    void flush()
+    {
+        mWriteIndex = mCachedReadIndex = mLocalReadIndex = mCachedCommittedIndex = 0;
+        mCommittedIndex = mReadIndex = 0;
+    }
+
+private:
+    // written by the producer
+    size_t mCommittedIndex = 0;
+    size_t mWriteIndex = 0;
+    size_t mCachedReadIndex = 0;
+
+    // written by the consumer
+    size_t mReadIndex = 0;
+    size_t mLocalReadIndex = 0;
+    size_t mCachedCommittedIndex = 0;
+
+    T mRaw[rawSize];
+};
+
+END_BLEMIDI_NAMESPACE
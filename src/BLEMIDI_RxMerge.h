@@ -0,0 +1,106 @@
+#pragma once
+
+#include "BLEMIDI_Defs.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Merges the RX streams of several connections (_Settings::MaxConnections) in the loop task.
+
+ One stream is read until it is empty and not within a SysEx, then the next one, so the messages
+ of different peers are not interleaved. A SysEx whose stream has had no data for RxSysExTimeout ms
+ is given up (its F7 was dropped, or the peer went quiet): the other streams are read again, the
+ next status byte ends the SysEx for the parser, and what is left of it is thrown away when it
+ arrives after all.
+
+ The backend provides, per slot (0 .. MaxConnections - 1):
+   bool rxPop(unsigned slot, byte *value)   next byte of the stream, false when empty
+   bool rxConnected(unsigned slot)          a peer is connected in the slot
+   bool rxStale(unsigned slot)              the peer is gone, what is left is to be thrown away
+   void rxClearStale(unsigned slot)         (called once it is)
+ */
+template <class _Settings>
+class BLEMIDI_RxMerge
+{
+private:
+    unsigned mReadSlot = 0;
+    bool mInSysEx = false;       // the slot being read is within a SysEx
+    unsigned long mLastData = 0; // millis() of the last byte of the slot being read
+
+    // the rest of a SysEx that was given up
+    bool mSkipSysEx[_Settings::MaxConnections] = {};
+
+public:
+    // the slot the last byte came from
+    unsigned slot() const
+    {
+        return mReadSlot;
+    }
+
+    template <class Backend>
+    bool available(Backend &backend, byte *value)
+    {
+        // throw away what is left of peers that are gone
+        for (unsigned slot = 0; slot < _Settings::MaxConnections; slot++)
+        {
+            if (!backend.rxStale(slot))
+                continue;
+
+            while (backend.rxPop(slot, value))
+            {
+            }
+            if (slot == mReadSlot)
+                mInSysEx = false;
+            mSkipSysEx[slot] = false;
+            backend.rxClearStale(slot);
+        }
+
+        for (unsigned n = 0; n < _Settings::MaxConnections; n++)
+        {
+            if (pop(backend, mReadSlot, value))
+            {
+                if (*value == SystemExclusiveStart)
+                    mInSysEx = true;
+                else if (*value >= MIDI_TYPE && *value < Clock) // System Real-Time does not end a SysEx
+                    mInSysEx = false;
+
+                mLastData = millis();
+                return true;
+            }
+
+            if (mInSysEx && backend.rxConnected(mReadSlot))
+            {
+                if (millis() - mLastData < _Settings::RxSysExTimeout)
+                    return false; // wait for the rest of the SysEx
+
+                mSkipSysEx[mReadSlot] = true;
+            }
+
+            mInSysEx = false;
+            mReadSlot = (mReadSlot + 1) % _Settings::MaxConnections;
+        }
+        return false;
+    }
+
+protected:
+    // the next byte of a slot, without the data bytes (and F7) of a SysEx that was given up
+    template <class Backend>
+    bool pop(Backend &backend, unsigned slot, byte *value)
+    {
+        while (backend.rxPop(slot, value))
+        {
+            if (!mSkipSysEx[slot] || *value >= Clock)
+                return true;
+
+            if (*value >= MIDI_TYPE)
+            {
+                mSkipSysEx[slot] = false;
+                if (*value != SystemExclusiveEnd)
+                    return true;
+            }
+        }
+        return false;
+    }
+};
+
+END_BLEMIDI_NAMESPACE
@@ -1,12 +1,172 @@
 #pragma once
 
 #include "BLEMIDI_Namespace.h"
+#include "BLEMIDI_Clock.h"
 
 BEGIN_BLEMIDI_NAMESPACE
 
+// see DefaultSettings::RxOverflow
+enum RxOverflowPolicy
+{
+    RxDropNewest,
+    RxDropOldest,
+    RxDropMessage,
+    RxBoundedWait,
+};
+
 struct DefaultSettings
 {
+    // Also the upper limit of an outgoing BLE packet. The actual size follows the
+    // MTU negotiated with the peer (ATT_MTU - 3), as reported by the backend.
     static const short MaxBufferSize = 64;
+
+    /*
+     Use a lock-free single-producer/single-consumer ring buffer (see BLEMIDI_RingBuffer.h)
+     instead of the FreeRTOS queue to pass decoded MIDI from the BLE task to the loop task.
+     The decoded messages of a BLE packet are published in one go, and read back in bulk.
+     Only used by backends that run the BLE stack in its own task (ESP32 NimBLE, and its client).
+     Always used with MaxConnections > 1, it keeps the messages of different peers apart.
+     */
+    static const bool UseRxRingBuffer = false;
+    static const short RxRingBufferSize = 256; // must be a power of 2
+
+    /*
+     Clock of the BLE-MIDI timestamps: of the messages sent (and setEventTime), and the local time
+     they are correlated with on receive (UsePlayout, UseLatencyProbe). A class with a static now()
+     in ms: MillisClock (millis()), EspTimerClock (esp_timer_get_time(), rounded to the ms, ESP32
+     only), VirtualClock (set by the application), or one of your own. See BLEMIDI_Clock.h.
+     */
+    typedef MillisClock TimestampClock;
+
+    /*
+     true: received runningStatus messages are passed on as they are (the status only follows
+     a timestamp byte), for a parser that accepts runningStatus (MIDI library default).
+     false: the status is repeated for every message, so they come out as full MIDI messages.
+     */
+    static const bool RxRunningStatus = true;
+
+    /*
+     Coalesce multiple MIDI messages into one BLE packet on transmit. Each message is appended
+     to the pending packet with its own timestamp byte. The packet is sent when it is full,
+     when flush() is called, or when its first message is TxCoalescingLatency ms old
+     (checked when sending, and in available(), so keep calling MIDI.read()).
+     */
+    static const bool UseTxCoalescing = false;
+    static const unsigned short TxCoalescingLatency = 5; // ms
+
+    /*
+     With UseTxCoalescing: leave out the status byte of a channel message that has the same status
+     as the previous message in the packet (running status), and its timestamp byte when that is
+     the same too. Running status restarts with every packet and after System Common messages.
+     */
+    static const bool UseTxRunningStatus = false;
+
+    /*
+     Play out received messages at the time they were sent (using the BLE-MIDI timestamps),
+     delayed by a fixed PlayoutLatency, instead of all at once when the packet arrives.
+     Trades a small constant delay for (near) zero connection interval jitter.
+     PlayoutLatency should cover the connection interval (7.5 - 40 ms) plus some margin.
+     See BLEMIDI_Playout.h. Keep calling MIDI.read(), messages are handed out when due.
+     */
+    static const bool UsePlayout = false;
+    static const unsigned short PlayoutLatency = 20; // ms
+    static const short PlayoutBufferSize = 256;      // bytes, must be a power of 2
+
+    /*
+     Pacing of sendSysExStream(): at most SysExStreamBurst packets every SysExStreamInterval ms,
+     so the notification buffers of the BLE stack are not overrun.
+     */
+    static const unsigned short SysExStreamBurst = 4;
+    static const unsigned short SysExStreamInterval = 8; // ms
+
+    /*
+     Number of centrals the ESP32 NimBLE server accepts at the same time, or number of servers
+     the ESP32 client connects to (both limited by CONFIG_BT_NIMBLE_MAX_CONNECTIONS).
+     Each connection has its own RX stream, see getRxConnection() and setTxConnection()
+     of the backend. A stream is read until it is empty and not within a SysEx; a SysEx that
+     has had no data for RxSysExTimeout ms is given up, so the others are not held up for long.
+     */
+    static const unsigned short MaxConnections = 1;
+    static const unsigned short RxSysExTimeout = 100; // ms
+
+    /*
+     Connection interval (ESP32 NimBLE server): while MIDI is sent or received, ask the central
+     for a short connection interval (ActiveInterval..), after IdleTimeout ms without traffic for a
+     longer one, with slave latency (IdleInterval.., IdleLatency). Intervals in units of 1.25 ms,
+     SupervisionTimeout in units of 10 ms. The central decides, getConnectionInterval() of the
+     backend tells what it granted.
+     */
+    static const bool UseAdaptiveInterval = false;
+    static const unsigned short ActiveIntervalMin = 6;  // 7.5 ms
+    static const unsigned short ActiveIntervalMax = 12; // 15 ms
+    static const unsigned short IdleIntervalMin = 48;   // 60 ms
+    static const unsigned short IdleIntervalMax = 96;   // 120 ms
+    static const unsigned short IdleLatency = 4;        // intervals the server may skip
+    static const unsigned short SupervisionTimeout = 400; // 4 s
+    static const unsigned long IdleTimeout = 5000;        // ms
+
+    /*
+     Packets (notifications, or writes of the client) a backend hands to the BLE stack per connection
+     before it waits for them to go out. availableForWrite() of the transport tells how much can be
+     written now, sendSysExStream() holds back when there are none left.
+     */
+    static const unsigned short TxCredits = 4;
+
+    /*
+     Send from a task of its own (ESP32 NimBLE server): the transport only puts the packet in a
+     queue of TxQueueSize packets, the TX task hands them to the BLE stack. When the stack is out of
+     buffers, the TX task waits and tries again (up to TxRetries times, 1 tick apart), not the
+     sender. A packet that does not fit in the queue is dropped (see Statistics::txDropped).
+     System Real-Time messages go through a queue of 4 of their own, which the TX task empties first.
+     */
+    static const bool UseTxTask = false;
+    static const short TxQueueSize = 8; // packets, must be a power of 2
+    static const unsigned TxTaskPriority = 1;
+    static const unsigned TxTaskStackSize = 2048; // bytes
+    static const unsigned short TxRetries = 20;
+
+    /*
+     ArduinoBLE: the stack only runs when BLE.poll() is called. With UseBLEPoll, the backend calls it
+     from MIDI.read() and when a packet is sent, every BLEPollInterval ms (0: every time the RX queue
+     is empty; while there is still data to read or send, at most once per ms), so keep calling
+     MIDI.read(). Received packets are decoded right away, from within BLE.poll().
+     Without it, the application calls BLE.poll() (or getBleClass().poll()) on a schedule of its own.
+     */
+    static const bool UseBLEPoll = true;
+    static const unsigned short BLEPollInterval = 0; // ms
+
+    /*
+     Keep counters of packets, bytes, messages, drops and failures (see BLEMIDI_Statistics.h),
+     read them with getStatistics(). When not set, nothing is counted or stored.
+     */
+    static const bool UseStatistics = false;
+
+    /*
+     Measure the latency: sendLatencyProbe() (and every LatencyProbeInterval ms, 0: only when called)
+     sends a tagged SysEx that the peer echoes (it needs UseLatencyProbe too). Round-trip times and
+     one-way estimates are counted in histograms of LatencyProbeBuckets buckets of
+     LatencyProbeBucketWidth us, see getLatencyProbe() and BLEMIDI_LatencyProbe.h.
+     Probes are not passed on to the application.
+     */
+    static const bool UseLatencyProbe = false;
+    static const unsigned short LatencyProbeInterval = 0; // ms
+    static const short LatencyProbeBuckets = 64;
+    static const unsigned LatencyProbeBucketWidth = 1000; // us
+
+    /*
+     What happens when a decoded byte does not fit in the RX queue of the backend (or in the jitter
+     buffer, UsePlayout): the loop task does not keep up. The BLE task never waits longer than
+     RxOverflowWait ms.
+     RxDropNewest:  the byte that does not fit is dropped
+     RxDropOldest:  the oldest message in the queue (its status and data bytes) is dropped to make
+                    room (not with UseRxRingBuffer, only the loop task may take bytes out of the
+                    ring; with UsePlayout the newest byte is dropped, for the same reason)
+     RxDropMessage: a message that does not fit as a whole is dropped, no partial messages
+     RxBoundedWait: wait (up to RxOverflowWait ms) for the loop task to make room, then drop the byte
+     Drops and waits are counted in the statistics.
+     */
+    static const RxOverflowPolicy RxOverflow = RxBoundedWait;
+    static const unsigned short RxOverflowWait = 10; // ms
 };
 
 END_BLEMIDI_NAMESPACE
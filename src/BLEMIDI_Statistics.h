@@ -0,0 +1,125 @@
+#pragma once
+
+#include "BLEMIDI_Defs.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+/*
+ Counters of a transport instance (see _Settings::UseStatistics), to size queues and
+ buffers from data. Filled by the transport (packets, bytes, messages) and by the
+ backend (RX queue depth and drops, failed notifications/writes, where the BLE stack
+ reports them). The receive side is updated from the BLE task: read it as a snapshot.
+ */
+struct Statistics
+{
+    unsigned long packetsReceived = 0;
+    unsigned long bytesReceived = 0;
+    unsigned long messagesDecoded = 0;
+    unsigned long malformedPackets = 0; // rejected, in part or as a whole
+
+    unsigned long packetsSent = 0; // taken by the BLE stack (not failed, not dropped)
+    unsigned long bytesSent = 0;
+    unsigned long txFailed = 0;  // notify() or writeValue() failed
+    unsigned long txDropped = 0; // packets that did not fit in the TX queue (UseTxTask)
+
+    unsigned long rxHighWater = 0;       // most bytes waiting in the RX queue
+    unsigned long rxDropped = 0;         // bytes that did not fit in the RX queue (or made room)
+    unsigned long rxDroppedMessages = 0; // whole messages dropped (RxDropMessage)
+    unsigned long rxWaits = 0;           // times the BLE task waited for room (RxBoundedWait)
+
+    unsigned long receiveMicros = 0; // time spent decoding, in receive()
+};
+
+template <class _Settings, bool enabled = _Settings::UseStatistics>
+class BLEMIDI_Statistics
+{
+private:
+    Statistics mStatistics;
+
+public:
+    const Statistics &get() const
+    {
+        return mStatistics;
+    }
+
+    void reset()
+    {
+        mStatistics = Statistics();
+    }
+
+    void packetReceived(size_t length, bool wellFormed, unsigned long micros)
+    {
+        mStatistics.packetsReceived++;
+        mStatistics.bytesReceived += length;
+        if (!wellFormed)
+            mStatistics.malformedPackets++;
+        mStatistics.receiveMicros += micros;
+    }
+
+    void messagesDecoded(unsigned count)
+    {
+        mStatistics.messagesDecoded += count;
+    }
+
+    void packetSent(size_t length)
+    {
+        mStatistics.packetsSent++;
+        mStatistics.bytesSent += length;
+    }
+
+    void txFailed()
+    {
+        mStatistics.txFailed++;
+    }
+
+    void txDropped()
+    {
+        mStatistics.txDropped++;
+    }
+
+    void rxQueued(size_t depth)
+    {
+        if (depth > mStatistics.rxHighWater)
+            mStatistics.rxHighWater = depth;
+    }
+
+    void rxDropped(size_t count = 1)
+    {
+        mStatistics.rxDropped += count;
+    }
+
+    void rxDroppedMessage()
+    {
+        mStatistics.rxDroppedMessages++;
+    }
+
+    void rxWaited()
+    {
+        mStatistics.rxWaits++;
+    }
+};
+
+// disabled, compiles to nothing
+template <class _Settings>
+class BLEMIDI_Statistics<_Settings, false>
+{
+public:
+    const Statistics &get() const
+    {
+        static const Statistics none;
+        return none;
+    }
+
+    void reset() {}
+    void packetReceived(size_t, bool, unsigned long) {}
+    void messagesDecoded(unsigned) {}
+    void packetSent(size_t) {}
+    void txFailed() {}
+    void txDropped() {}
+    void rxQueued(size_t) {}
+    void rxDropped(size_t = 1) {}
+    void rxDroppedMessage() {}
+    void rxWaited() {}
+};
+
+END_BLEMIDI_NAMESPACE
@@ -4,11 +4,15 @@
 
 #pragma once
 
+#include "BLEMIDI_Defs.h" // before MIDI.h, provides millis() on host builds
+
 #include <MIDI.h>
 
 #include "BLEMIDI_Settings.h"
-#include "BLEMIDI_Defs.h"
 #include "BLEMIDI_Namespace.h"
+#include "BLEMIDI_Playout.h"
+#include "BLEMIDI_Statistics.h"
+#include "BLEMIDI_LatencyProbe.h"
 
 BEGIN_BLEMIDI_NAMESPACE
 
@@ -23,6 +27,20 @@ static const char *const CHARACTERISTIC_UUID = "7772e5db-3868-4112-a1a9-f2669d10
 
 #define MIDI_TYPE 0x80
 
+/*
+ A decoded MIDI message, see BLEMIDI_Transport::readMessages(). length is the size of the
+ message in bytes, status included (1 - 3), as in the MIDI library.
+ A SysEx comes in pieces of up to 2 data bytes: status SystemExclusiveStart, and
+ SystemExclusiveEnd for the last piece (which can have no data bytes).
+ */
+struct RxMessage
+{
+    byte status;
+    byte data1;
+    byte data2;
+    byte length;
+};
+
 template <class T, class _Settings = DefaultSettings>
 class BLEMIDI_Transport
 {
@@ -32,11 +50,57 @@ private:
 
     byte mTxBuffer[_Settings::MaxBufferSize]; // minimum 5 bytes
     unsigned mTxIndex = 0;
+    unsigned mTxPacketSize = _Settings::MaxBufferSize; // follows the negotiated MTU, see setMtu
+    volatile unsigned mTxPacketSizeNext = _Settings::MaxBufferSize; // taken at the next packet boundary
 
     char mDeviceName[24];
 
     uint8_t mTimestampLow;
 
+    // coalescing of messages in the TX packet
+    unsigned mTxMessageStart = 0;  // index of the timestamp byte of the current message
+    unsigned long mTxPacketTime = 0; // millis() of the first message in the packet
+    bool mTxWrapped = false;         // timestampLow overflowed in this packet
+    bool mTxSysEx = false;
+
+    // running status on transmit (_Settings::UseTxRunningStatus)
+    byte mTxRunningStatus = 0;    // status of the previous channel message in the packet, 0: none
+    byte mTxRunningTimestamp = 0; // its timestamp byte, 0: the next message needs its own
+
+    bool mTxRealTime = false; // System Real-Time message, see writeRealTime
+    uint8_t mTxRealTimeHeader = 0x80; // its timestampHigh, see realTimeHeader
+
+    // time of the next message (setEventTime), and of the last message stamped, TimestampClock
+    unsigned long mTxEventTime = 0;
+    bool mTxEventTimeSet = false;
+    unsigned long mTxLastTime = 0;
+
+    BLEMIDI_Playout<_Settings> mPlayout;
+
+    BLEMIDI_Statistics<_Settings> mStatistics;
+
+    bool mRxWaitTimedOut = false; // RxBoundedWait, for the packet being decoded
+
+    BLEMIDI_LatencyProbe<_Settings> mLatencyProbe;
+
+    // message being assembled by readMessages()
+    RxMessage mRxMessage = {0, 0, 0, 0};
+    byte mRxRunningStatus = 0; // 0: none, SystemExclusiveStart: within a SysEx
+
+public:
+    // fills (up to) length bytes of SysEx data (without F0/F7), returns how many, 0 at the end
+    using SysExStreamProducer = size_t (*)(byte *buffer, size_t length);
+    // number of data bytes sent so far, done is set when the SysEx is complete
+    using SysExStreamProgress = void (*)(size_t bytesSent, bool done);
+    // called by readMessages() for every decoded message
+    using MessageHandler = void (*)(const RxMessage &message);
+
+private:
+    SysExStreamProducer mSysExProducer = nullptr;
+    SysExStreamProgress mSysExProgress = nullptr;
+    size_t mSysExSent = 0;
+    unsigned long mSysExBurstTime = 0;
+
 private:
     T mBleClass;
 
@@ -62,21 +126,148 @@ public:
         mBleClass.end();
     }
 
+    // direct access to the backend, e.g. to inject packets into BLEMIDI_Loopback
+    T &getBleClass()
+    {
+        return mBleClass;
+    }
+
+    // all zero, unless _Settings::UseStatistics
+    const Statistics &getStatistics()
+    {
+        return mStatistics.get();
+    }
+
+    void resetStatistics()
+    {
+        mStatistics.reset();
+    }
+
+    // round trip and one-way histograms, see _Settings::UseLatencyProbe
+    BLEMIDI_LatencyProbe<_Settings> &getLatencyProbe()
+    {
+        return mLatencyProbe;
+    }
+
+    // false when not enabled, or while a SysEx is streamed
+    bool sendLatencyProbe()
+    {
+        byte payload[BLEMIDI_LatencyProbe<_Settings>::Length];
+        return !mSysExProducer && mLatencyProbe.ping(payload) && sendProbe(payload);
+    }
+
+    // for the backend, to count queue depth, drops and failures
+    BLEMIDI_Statistics<_Settings> &statistics()
+    {
+        return mStatistics;
+    }
+
+    /*
+     Stamps the next message with the time the event happened (TimestampClock::now() at that
+     moment, millis() by default, e.g. taken in an ISR), instead of the time it is sent, so the receiver can render the original timing:
+       BLEMIDI.setEventTime(t);
+       MIDI.sendNoteOn(60, 127, 1);
+     Timestamps must go up and can not lie in the future. A time before the previous message is
+     sent as the time of that message, a time in the future as now, and false is returned.
+     Only 13 bits (8191 ms) reach the receiver, keep the events recent.
+     */
+    bool setEventTime(unsigned long milliseconds)
+    {
+        auto now = _Settings::TimestampClock::now();
+
+        bool valid = true;
+        if ((long)(milliseconds - now) > 0)
+        {
+            milliseconds = now;
+            valid = false;
+        }
+        if ((long)(milliseconds - mTxLastTime) < 0)
+        {
+            milliseconds = mTxLastTime;
+            valid = false;
+        }
+
+        mTxEventTime = milliseconds;
+        mTxEventTimeSet = true;
+        return valid;
+    }
+
     bool beginTransmission(MIDI_NAMESPACE::MidiType type)
     {
-        getMidiTimestamp(&mTxBuffer[0], &mTxBuffer[1]);
-        mTxIndex = 2;
-        mTimestampLow = mTxBuffer[1]; // or generate new ?
+        // System Real-Time jumps ahead of what is pending, see writeRealTime
+        if (type >= Clock)
+        {
+            mTxRealTime = true;
+            return true;
+        }
+
+        // nothing else can go in between the packets of a streamed SysEx
+        if (mSysExProducer)
+        {
+            mTxEventTimeSet = false; // that message is not sent
+            return false;
+        }
+
+        uint8_t header;
+        uint8_t timestamp;
+        getMidiTimestamp(txTime(), &header, &timestamp);
+
+        // append to the pending packet, if the timestamp can be expressed in it
+        // (and the packet size did not change, see setMtu)
+        if (_Settings::UseTxCoalescing && mTxIndex > 0)
+            if (txDeadlinePassed() || !txTimestampFits(header, timestamp) || mTxPacketSizeNext != mTxPacketSize)
+                flush();
+
+        if (mTxIndex == 0)
+        {
+            mTxPacketSize = mTxPacketSizeNext;
+            mTxBuffer[mTxIndex++] = header;
+            mTxPacketTime = millis();
+            mTxWrapped = false;
+            mTxRunningStatus = 0; // the end of a BLE packet cancels running status
+        }
+        else if ((header & 0x3F) != (mTxBuffer[0] & 0x3F))
+            mTxWrapped = true; // timestampLow overflowed within this packet
+
+        mTxMessageStart = mTxIndex;
+        mTxSysEx = (type == SystemExclusive);
+
+        mTxBuffer[mTxIndex++] = timestamp;
+        mTimestampLow = timestamp; // or generate new ?
 
         return true;
     }
 
     void write(byte inData)
     {
-        if (mTxIndex >= sizeof(mTxBuffer))
+        if (mTxRealTime)
         {
-            mBleClass.write(mTxBuffer, sizeof(mTxBuffer));
-            mTxIndex = 1; // keep header
+            writeRealTime(inData);
+            return;
+        }
+
+        if (mTxIndex >= mTxPacketSize)
+        {
+            if (_Settings::UseTxCoalescing && !mTxSysEx && mTxMessageStart > 1)
+            {
+                // send the complete messages, and move the incomplete one into a new packet
+                auto partial = mTxIndex - mTxMessageStart;
+                writePacket(mTxBuffer, mTxMessageStart);
+                memmove(&mTxBuffer[1], &mTxBuffer[mTxMessageStart], partial);
+                mTxIndex = 1 + partial;
+                mTxMessageStart = 1;
+                mTxPacketTime = millis();
+                mTxRunningStatus = 0;
+            }
+            else
+            {
+                writePacket(mTxBuffer, mTxIndex);
+                mTxIndex = 1; // keep header
+            }
+
+            // the new packet starts at the timestampHigh of the last message
+            mTxBuffer[0] = ((mTxBuffer[0] + mTxWrapped) & 0x3F) | 0x80;
+            mTxWrapped = false;
         }
 
         mTxBuffer[mTxIndex++] = inData;
@@ -84,12 +275,20 @@ public:
 
     void endTransmission()
     {
+        if (mTxRealTime)
+        {
+            mTxRealTime = false; // already sent
+            return;
+        }
+
         if (mTxBuffer[mTxIndex - 1] == SystemExclusiveEnd)
         {
-            if (mTxIndex >= sizeof(mTxBuffer))
+            if (mTxIndex >= mTxPacketSize)
             {
-                mBleClass.write(mTxBuffer, mTxIndex - 1);
+                writePacket(mTxBuffer, mTxIndex - 1);
 
+                mTxBuffer[0] = ((mTxBuffer[0] + mTxWrapped) & 0x3F) | 0x80;
+                mTxWrapped = false;
                 mTxIndex = 1;                          // keep header
                 mTxBuffer[mTxIndex++] = mTimestampLow; // or generate new ?
             }
@@ -100,10 +299,106 @@ public:
             mTxBuffer[mTxIndex++] = SystemExclusiveEnd;
         }
 
-        mBleClass.write(mTxBuffer, mTxIndex);
+        if (_Settings::UseTxCoalescing)
+        {
+            if (_Settings::UseTxRunningStatus)
+                compressRunningStatus();
+
+            // keep collecting messages, until a channel message no longer fits or the deadline passes
+            // (one that does not fit after all is moved into the next packet by write)
+            if (mTxIndex + (_Settings::UseTxRunningStatus ? 2 : 4) > mTxPacketSize || txDeadlinePassed())
+                flush();
+            return;
+        }
+
+        writePacket(mTxBuffer, mTxIndex);
         mTxIndex = 0;
     }
 
+    // called by the backend when connected and when the ATT MTU changes (from the BLE task, while
+    // the loop task may be building a packet: the new size is taken when the next packet is started)
+    void setMtu(uint16_t mtu)
+    {
+        // a notification (or write) carries ATT_MTU - 3 bytes,
+        // limited by the size of the TX buffer (_Settings::MaxBufferSize)
+        unsigned size = (mtu > 3) ? mtu - 3 : 0;
+        if (size > sizeof(mTxBuffer))
+            size = sizeof(mTxBuffer);
+        if (size < 5)
+            size = 5;
+
+        mTxPacketSizeNext = size;
+    }
+
+    // the header (timestampHigh) of the System Real-Time message that ends the packet being written,
+    // for a backend that sends that message on its own: in a SysEx continuation packet, or one whose
+    // timestampLow wrapped, it can not be told from the packet
+    uint8_t realTimeHeader() const
+    {
+        return mTxRealTimeHeader;
+    }
+
+    /*
+     Bytes (timestamp bytes included) that can be written now without waiting for the BLE stack, or
+     being dropped by it: the room in the pending packet and in the packets the backend can still
+     hand to the stack (_Settings::TxCredits). 0 when no peer is connected (or subscribed),
+     and while a SysEx is streamed.
+     */
+    int availableForWrite()
+    {
+        if (mSysExProducer)
+            return 0;
+
+        unsigned packets = mBleClass.txCredits();
+        if (packets == 0)
+            return 0;
+
+        // every packet starts with a header byte
+        unsigned pending = (mTxIndex > 0) ? mTxIndex - 1 : 0;
+        return packets * (mTxPacketSize - 1) - pending;
+    }
+
+    // send the pending packet now (coalescing)
+    void flush()
+    {
+        if (mTxIndex == 0 || mSysExProducer)
+            return;
+
+        writePacket(mTxBuffer, mTxIndex);
+        mTxIndex = 0;
+    }
+
+    /*
+     Sends a SysEx of any size, without having it in RAM: the producer is called for the next
+     chunk of data whenever there is room in the packet. Packets are paced, at most
+     _Settings::SysExStreamBurst packets every _Settings::SysExStreamInterval ms, and only while
+     the backend has TX credits, so the BLE stack is not overrun. The stream is advanced by available(), so keep calling MIDI.read().
+     The SysEx ends when the producer returns 0 (or a byte with bit 7 set).
+     Other messages can not be sent while streaming (beginTransmission returns false),
+     except System Real-Time messages, they are interleaved with the SysEx.
+     */
+    bool sendSysExStream(SysExStreamProducer producer, SysExStreamProgress progress = nullptr)
+    {
+        if (mSysExProducer || producer == nullptr)
+            return false; // busy
+
+        beginTransmission(SystemExclusive);
+        write(SystemExclusiveStart);
+
+        mSysExProducer = producer;
+        mSysExProgress = progress;
+        mSysExSent = 0;
+        mSysExBurstTime = millis() - _Settings::SysExStreamInterval;
+
+        pollSysExStream();
+        return true;
+    }
+
+    bool isSysExStreaming()
+    {
+        return mSysExProducer != nullptr;
+    }
+
     byte read()
     {
         return mRxBuffer[--mRxIndex];
@@ -111,16 +406,375 @@ public:
 
     unsigned available()
     {
+        poll();
+
         uint8_t byte;
-        auto success = mBleClass.available(&byte);
-        if (!success)
+        if (!nextByte(byte))
             return mRxIndex;
 
         mRxBuffer[mRxIndex++] = byte;
         return mRxIndex;
     }
 
+    /*
+     Without the MIDI library parser: takes all messages decoded since the last call (at most
+     count) in one go, instead of a pair of available()/read() calls per byte.
+     Returns the number of messages. Does the same housekeeping as available() (coalescing,
+     sendSysExStream), so it can replace MIDI.read() in the loop. Use one or the other.
+     */
+    size_t readMessages(RxMessage *messages, size_t count)
+    {
+        poll();
+
+        size_t n = 0;
+        while (n < count && nextMessage(messages[n]))
+            n++;
+        return n;
+    }
+
+    // the same, with a handler that is called for every message (getRxConnection() of the
+    // backend tells where it came from). Returns the number of messages.
+    size_t readMessages(MessageHandler handler)
+    {
+        poll();
+
+        size_t n = 0;
+        RxMessage message;
+        while (nextMessage(message))
+        {
+            handler(message);
+            n++;
+        }
+        return n;
+    }
+
 protected:
+    // the loop calls MIDI.read() regularly, send coalesced messages when they are due
+    void poll()
+    {
+        if (mSysExProducer)
+            pollSysExStream();
+        else if (_Settings::UseTxCoalescing && mTxIndex > 0 && txDeadlinePassed())
+            flush();
+
+        // echo the probes of the peer, and send our own
+        byte payload[BLEMIDI_LatencyProbe<_Settings>::Length];
+        while (mLatencyProbe.echo(payload))
+            sendProbe(payload);
+        if (mLatencyProbe.due())
+            sendLatencyProbe();
+    }
+
+    // a probe goes the way of any other message (coalescing, MTU), but is not split across
+    // packets, so the decoder finds it in one piece
+    bool sendProbe(const byte *payload)
+    {
+        if (mSysExProducer)
+            return false;
+
+        // timestamp, F0, payload, timestampLow, F7
+        if (mTxIndex > 0 && mTxIndex + BLEMIDI_LatencyProbe<_Settings>::Length + 4 > mTxPacketSize)
+            flush();
+        beginTransmission(SystemExclusive);
+        write(SystemExclusiveStart);
+        for (size_t i = 0; i < BLEMIDI_LatencyProbe<_Settings>::Length; i++)
+            write(payload[i]);
+        write(SystemExclusiveEnd);
+        endTransmission();
+        return true;
+    }
+
+    bool nextByte(byte &value)
+    {
+        if (mBleClass.available(&value))
+            return true;
+        return _Settings::UsePlayout && mPlayout.available(&value); // messages that are due
+    }
+
+    // assembles the next message from the decoded bytes, false when there is none (yet)
+    bool nextMessage(RxMessage &message)
+    {
+        if (takeMessage(message))
+            return true; // started when the previous one (end of SysEx) was returned
+
+        byte value;
+        while (nextByte(value))
+        {
+            if (value >= Clock)
+            {
+                // System Real-Time, also in the middle of a SysEx
+                message = {value, 0, 0, 1};
+                return true;
+            }
+
+            auto &m = mRxMessage;
+
+            if (value >= MIDI_TYPE)
+            {
+                if (mRxRunningStatus == SystemExclusiveStart)
+                {
+                    // any status ends the SysEx
+                    mRxRunningStatus = 0;
+                    message = {SystemExclusiveEnd, m.data1, m.data2, m.length};
+                    m.length = 0;
+
+                    if (value != SystemExclusiveEnd)
+                        startMessage(value);
+                    return true;
+                }
+
+                if (value == SystemExclusiveEnd)
+                    continue; // without a SysEx
+
+                // an incomplete message is dropped
+                startMessage(value);
+            }
+            else if (mRxRunningStatus == SystemExclusiveStart)
+            {
+                (m.length == 1 ? m.data1 : m.data2) = value;
+                if (++m.length == 3)
+                {
+                    message = m;
+                    m = {SystemExclusiveStart, 0, 0, 1};
+                    return true;
+                }
+                continue;
+            }
+            else
+            {
+                if (m.length == 0)
+                {
+                    if (mRxRunningStatus == 0)
+                        continue; // data without status
+                    startMessage(mRxRunningStatus); // runningStatus
+                }
+
+                (m.length == 1 ? m.data1 : m.data2) = value;
+                m.length++;
+            }
+
+            if (takeMessage(message))
+                return true;
+        }
+        return false;
+    }
+
+    // the message being assembled, when it is complete
+    bool takeMessage(RxMessage &message)
+    {
+        auto &m = mRxMessage;
+        if (m.length == 0 || m.length != 1 + messageDataLength(m.status))
+            return false;
+
+        message = m;
+        m.length = 0;
+        return true;
+    }
+
+    void startMessage(byte status)
+    {
+        mRxMessage = {status, 0, 0, 1};
+
+        if (status <= SystemExclusiveStart)
+            mRxRunningStatus = status;
+        else
+            mRxRunningStatus = 0; // System Common, no running status after it
+    }
+
+    static byte messageDataLength(byte status)
+    {
+        switch (status)
+        {
+        case TimeCodeQuarterFrame:
+        case SongSelect:
+            return 1;
+        case SongPosition:
+            return 2;
+        case SystemExclusiveStart:
+            return 0xFF; // up to SystemExclusiveEnd
+        default:
+            return dataLength[status >> 4];
+        }
+    }
+
+    void writePacket(byte *buffer, size_t length)
+    {
+        // counted when the backend handed it to the stack (a failure is counted by the backend)
+        if (mBleClass.write(buffer, length))
+            mStatistics.packetSent(length);
+
+        // a packet boundary: what is carried over into the next packet (header, a partial message)
+        // is shorter than the smallest packet size
+        mTxPacketSize = mTxPacketSizeNext;
+    }
+
+    /*
+     System Real-Time messages (Timing Clock, Start/Stop, Active Sensing) do not wait behind
+     pending messages: they are appended to the packet being built and that packet is sent
+     right away. In the middle of a SysEx (sendSysExStream) that is allowed by the spec,
+     the SysEx continues after it, in the next packet.
+     */
+    void writeRealTime(byte status)
+    {
+        uint8_t header;
+        uint8_t timestamp;
+        getMidiTimestamp(txTime(), &header, &timestamp);
+
+        if (mTxIndex > 0 && (mTxIndex + 2 > mTxPacketSize || !txTimestampFits(header, timestamp)))
+        {
+            // no room, send what is pending first
+            writePacket(mTxBuffer, mTxIndex);
+            mTxIndex = 0;
+        }
+
+        if (mTxIndex == 0)
+        {
+            mTxBuffer[mTxIndex++] = header;
+            mTxWrapped = false;
+        }
+        else if ((header & 0x3F) != (mTxBuffer[0] & 0x3F))
+            mTxWrapped = true;
+
+        mTxBuffer[mTxIndex++] = timestamp;
+        mTxBuffer[mTxIndex++] = status;
+        mTxRealTimeHeader = header;
+        mTxRunningTimestamp = 0; // does not cancel running status, but the next message needs a timestamp
+        mTimestampLow = timestamp;
+
+        writePacket(mTxBuffer, mTxIndex);
+
+        if (mSysExProducer)
+        {
+            // the next packet continues the SysEx
+            mTxBuffer[0] = header;
+            mTxWrapped = false;
+            mTxIndex = 1;
+        }
+        else
+            mTxIndex = 0;
+    }
+
+    void pollSysExStream()
+    {
+        if (millis() - mSysExBurstTime < _Settings::SysExStreamInterval)
+            return;
+        mSysExBurstTime = millis();
+
+        unsigned packets = 0;
+        while (packets < _Settings::SysExStreamBurst)
+        {
+            if (mTxIndex >= mTxPacketSize)
+            {
+                if (mBleClass.txCredits() == 0)
+                    break; // the stack is still busy with the previous packets, next burst
+
+                writePacket(mTxBuffer, mTxIndex);
+                packets++;
+
+                // keep header (of the last message), the next packet continues the SysEx
+                mTxBuffer[0] = ((mTxBuffer[0] + mTxWrapped) & 0x3F) | 0x80;
+                mTxWrapped = false;
+                mTxIndex = 1;
+                continue;
+            }
+
+            // let the producer fill the packet directly
+            auto data = &mTxBuffer[mTxIndex];
+            auto length = mSysExProducer(data, mTxPacketSize - mTxIndex);
+
+            size_t valid = 0;
+            while (valid < length && data[valid] < MIDI_TYPE)
+                valid++;
+
+            mTxIndex += valid;
+            mSysExSent += valid;
+
+            if (length == 0 || valid < length)
+            {
+                // end of the SysEx
+                mSysExProducer = nullptr;
+                write(SystemExclusiveEnd);
+                endTransmission();
+
+                if (mSysExProgress)
+                    mSysExProgress(mSysExSent, true);
+                return;
+            }
+        }
+
+        if (mSysExProgress)
+            mSysExProgress(mSysExSent, false);
+    }
+
+    /*
+     Running status on transmit, applied to the message just completed (mTxMessageStart up to
+     mTxIndex: timestamp, status, data). The spec allows to leave out the status of a channel
+     message that has the same status as the most recent full message in the packet, and the
+     timestamp byte when the message has the timestamp of the previous message. System Common
+     and System Real-Time do not cancel running status, but a timestamp byte must precede the
+     running status message that follows (we do cancel it after System Common, and SysEx).
+     */
+    void compressRunningStatus()
+    {
+        if (mTxSysEx || mTxIndex < mTxMessageStart + 2)
+        {
+            mTxRunningStatus = 0;
+            return;
+        }
+
+        auto timestamp = mTxBuffer[mTxMessageStart];
+        auto status = mTxBuffer[mTxMessageStart + 1];
+        if (status >= SystemExclusive)
+        {
+            mTxRunningStatus = 0; // System Common
+            return;
+        }
+
+        if (status == mTxRunningStatus)
+        {
+            // drop the status byte, and the timestamp byte if it is the same as the previous one
+            unsigned drop = (timestamp == mTxRunningTimestamp) ? 2 : 1;
+            unsigned data = mTxMessageStart + 2;
+            memmove(&mTxBuffer[data - drop], &mTxBuffer[data], mTxIndex - data);
+            mTxIndex -= drop;
+        }
+
+        mTxRunningStatus = status;
+        mTxRunningTimestamp = timestamp;
+    }
+
+    bool txDeadlinePassed()
+    {
+        return (millis() - mTxPacketTime) >= _Settings::TxCoalescingLatency;
+    }
+
+    // time of the message being sent: the event time when set (once), now otherwise,
+    // and never before the previous message
+    unsigned long txTime()
+    {
+        auto time = mTxEventTimeSet ? mTxEventTime : _Settings::TimestampClock::now();
+        mTxEventTimeSet = false;
+
+        if ((long)(time - mTxLastTime) < 0)
+            time = mTxLastTime;
+        mTxLastTime = time;
+        return time;
+    }
+
+    // A packet has 1 timestampHigh (in the header), the receiver adds 1 when timestampLow goes down.
+    // So a message can only be appended when it has the same timestampHigh as the previous message,
+    // or the next one, if that did not happen before in this packet.
+    bool txTimestampFits(uint8_t header, uint8_t timestamp)
+    {
+        auto lastHigh = (mTxBuffer[0] + mTxWrapped) & 0x3F;
+        auto high = header & 0x3F;
+
+        if (high == lastHigh)
+            return timestamp >= mTimestampLow;
+
+        return !mTxWrapped && (high == ((lastHigh + 1) & 0x3F)) && (timestamp < mTimestampLow);
+    }
+
     /*
      The first byte of all BLE packets must be a header byte. This is followed by timestamp bytes and MIDI messages.
      
@@ -158,16 +812,17 @@ protected:
 
     /*
      Calculating a Timestamp
-     To calculate the timestamp, the built-in millis() is used.
+     To calculate the timestamp, _Settings::TimestampClock is used, the built-in millis() by default
+     (or the time of the event, see setEventTime).
      The BLE standard only specifies 13 bits worth of millisecond data though,
      so it’s bitwise anded with 0x1FFF for an ever repeating cycle of 13 bits.
      This is done right after a MIDI message is detected. It’s split into a 6 upper bits, 7 lower bits,
      and the MSB of both bytes are set to indicate that this is a header byte.
      Both bytes are placed into the first two position of an array in preparation for a MIDI message.
      */
-    static void getMidiTimestamp(uint8_t *header, uint8_t *timestamp)
+    static void getMidiTimestamp(unsigned long time, uint8_t *header, uint8_t *timestamp)
     {
-        auto currentTimeStamp = millis() & 0x01FFF;
+        auto currentTimeStamp = time & 0x01FFF;
 
         *header = ((currentTimeStamp >> 7) & 0x3F) | 0x80; // 6 bits plus MSB
         *timestamp = (currentTimeStamp & 0x7F) | 0x80;     // 7 bits plus MSB
@@ -242,180 +897,233 @@ public:
     from other messages – except for System Exclusive messages.
     */
 
-/**
-   * If #define RUNNING_ENABLE is commented/disabled, it will transform all incoming runningStatus messages in full midi messages.
-   * Else, it will put in the buffer the same info that it had received (runningStatus will be not transformated).
-   * It recommend not use runningStatus by default. Only use if parser accepts runningStatus and your application has a so high transmission rate.
-   */
-#define RUNNING_ENABLE
-
     void receive(byte *buffer, size_t length)
     {
-        // Pointers used to search through payload.
-        int lPtr = 0;
-        int rPtr = 0;
+        unsigned long t0 = _Settings::UseStatistics ? micros() : 0;
+        mRxWaitTimedOut = false;
 
-        // lastStatus used to capture runningStatus
-        byte lastStatus;
-        // previousStatus used to continue a runningStatus interrupted by a timeStamp or a System Message.
-        byte previousStatus = InvalidType;
+        auto wellFormed = decode(buffer, length);
+
+        mStatistics.packetReceived(length, wellFormed, _Settings::UseStatistics ? micros() - t0 : 0);
 
-        byte headerByte = buffer[lPtr++];
+        // hand over all messages of this packet to the jitter buffer at once
+        if (_Settings::UsePlayout)
+            mPlayout.commit();
+    }
 
-        auto timestampHigh = 0x3f & headerByte;
-        timestampHigh = timestampHigh; // <-- This line is for avoid Warning message due it is unused
-        byte timestampByte = buffer[lPtr++];
-        uint16_t timestamp = 0;
-        timestamp = timestamp; // <-- This line is for avoid Warning message due it is unused
-        bool sysExContinuation = false;
-        bool runningStatusContinuation = false;
+protected:
+    void add(byte value)
+    {
+        if (queue(value))
+            return;
 
-        if (timestampByte >= MIDI_TYPE) // if bit 7 is 1, it's a timestampByte
+        // the RX queue of the backend (or the jitter buffer) is full, see _Settings::RxOverflow
+        if (_Settings::RxOverflow == RxDropOldest && !_Settings::UsePlayout)
         {
-            timestamp = setMidiTimestamp(headerByte, timestampByte);
-            // what do to with the timestamp?
+            mStatistics.rxDropped(dropOldest());
+            if (queue(value))
+                return;
         }
-        else // if bit 7 is 0, it's the Continuation of a previous SysEx
+        else if (_Settings::RxOverflow == RxBoundedWait && !mRxWaitTimedOut)
         {
-            sysExContinuation = true;
-            lPtr--; // the second byte is part of the SysEx
+            // hand over what is in the jitter buffer, the loop task takes it out when due
+            if (_Settings::UsePlayout)
+                mPlayout.commit();
+
+            for (unsigned ms = 0; ms < _Settings::RxOverflowWait && mBleClass.rxWait(); ms++)
+            {
+                if (ms == 0)
+                    mStatistics.rxWaited();
+                if (queue(value))
+                    return;
+            }
+
+            // the loop task is stuck, do not wait again for the rest of this packet
+            mRxWaitTimedOut = true;
         }
 
-        //While statement contains incrementing pointers and breaks when buffer size exceeded.
-        while (true)
+        mStatistics.rxDropped();
+    }
+
+    /*
+     RxDropOldest: the oldest message in the RX queue of the backend makes room, its status and the
+     data bytes after it up to the next status, so they are not left behind to be taken for running
+     status (a SysEx up to its F7). The backend hands out the oldest byte (peekOldest, popOldest).
+     */
+    size_t dropOldest()
+    {
+        byte value;
+        if (!mBleClass.popOldest(&value))
+            return 0;
+
+        size_t dropped = 1;
+        while (mBleClass.peekOldest(&value) && (value < MIDI_TYPE || value == SystemExclusiveEnd))
         {
-            lastStatus = buffer[lPtr];
+            mBleClass.popOldest(&value);
+            dropped++;
+            if (value == SystemExclusiveEnd)
+                break;
+        }
+        return dropped;
+    }
 
-            if (previousStatus == InvalidType)
-            {
-                if ((lastStatus < MIDI_TYPE) && !sysExContinuation)
-                    return; // Status message not present and it is not a runningStatus continuation, bail
-            }
-            else if (lastStatus < MIDI_TYPE)
-            {
-                lastStatus = previousStatus;
-                runningStatusContinuation = true;
-            }
+    // into the jitter buffer (played out by available(), when due), or the RX queue of the backend
+    bool queue(byte value)
+    {
+        if (_Settings::UsePlayout)
+            return mPlayout.add(value);
 
-            // Point to next non-data byte
-            rPtr = lPtr;
-            while ((buffer[rPtr + 1] < MIDI_TYPE) && (rPtr < (length - 1)))
-                rPtr++;
+        return mBleClass.add(value);
+    }
 
-            if (!runningStatusContinuation)
-            {
-                // If not System Common or System Real-Time, send it as running status
+    size_t rxFree()
+    {
+        if (_Settings::UsePlayout)
+            return mPlayout.space();
 
-                auto midiType = lastStatus & 0xF0;
-                if (sysExContinuation)
-                    midiType = SystemExclusive;
+        return mBleClass.rxFree();
+    }
 
-                switch (midiType)
-                {
-                case NoteOff:
-                case NoteOn:
-                case AfterTouchPoly:
-                case ControlChange:
-                case PitchBend:
-#ifdef RUNNING_ENABLE
-                    mBleClass.add(lastStatus);
-#endif
-                    for (auto i = lPtr; i < rPtr; i = i + 2)
-                    {
-#ifndef RUNNING_ENABLE
-                        mBleClass.add(lastStatus);
-#endif
-                        mBleClass.add(buffer[i + 1]);
-                        mBleClass.add(buffer[i + 2]);
-                    }
-                    break;
-                case ProgramChange:
-                case AfterTouchChannel:
-#ifdef RUNNING_ENABLE
-                    mBleClass.add(lastStatus);
-#endif
-                    for (auto i = lPtr; i < rPtr; i = i + 1)
-                    {
-#ifndef RUNNING_ENABLE
-                        mBleClass.add(lastStatus);
-#endif
-                        mBleClass.add(buffer[i + 1]);
-                    }
-                    break;
-                case SystemExclusive:
-                    mBleClass.add(lastStatus);
-                    for (auto i = lPtr; i < rPtr; i++)
-                        mBleClass.add(buffer[i + 1]);
-
-                    break;
-
-                default:
-                    break;
-                }
+    // RxDropMessage: when the message (the status, if any, and the data bytes from i on) does not
+    // fit in the RX queue as a whole, it is skipped and false is returned
+    bool roomForMessage(byte *buffer, size_t length, size_t &i, byte status, size_t statusBytes)
+    {
+        if (_Settings::RxOverflow != RxDropMessage)
+            return true;
+
+        auto end = i;
+        while (end < length && buffer[end] < MIDI_TYPE)
+            end++;
+
+        auto size = statusBytes + (end - i);
+        if (!_Settings::RxRunningStatus)
+        {
+            // the status is repeated for every runningStatus message
+            auto n = dataLength[status >> 4];
+            if (n > 0 && end - i > n)
+                size += (end - i - 1) / n;
+        }
+
+        if (rxFree() >= size)
+            return true;
+
+        i = end;
+        mStatistics.rxDroppedMessage();
+        return false;
+    }
+
+    // returns false if (part of) the packet had to be skipped
+    bool decode(byte *buffer, size_t length)
+    {
+        // Single pass over the packet, every read is bounds checked.
+        // Every message starts with a timestamp byte, followed by a status byte, or by data
+        // bytes (running status). The data bytes run up to the next byte with bit 7 set.
+        if (length < 2 || buffer[0] < MIDI_TYPE)
+            return false; // no header
+
+        size_t i = 1;
+
+        // timestampHigh is incremented when timestampLow wraps within the packet
+        byte timestampHigh = buffer[0];
+        byte lastTimestampByte = 0;
+
+        // previousStatus used to continue a runningStatus interrupted by a timeStamp or a System Message.
+        byte previousStatus = InvalidType;
+
+        if (buffer[i] < MIDI_TYPE)
+        {
+            // if bit 7 is 0, it's the Continuation of a previous SysEx
+            mPlayout.continuation();
+            if (roomForMessage(buffer, length, i, 0, 0))
+                addData(buffer, length, i, 0, 0);
+        }
+
+        unsigned messages = 0;
+        bool wellFormed = true;
+
+        while (i < length)
+        {
+            // timestamp
+            auto timestampByte = buffer[i++];
+            if (timestampByte < lastTimestampByte)
+                timestampHigh++;
+            lastTimestampByte = timestampByte;
+
+            mPlayout.timestamp(setMidiTimestamp(timestampHigh, timestampByte));
+
+            if (i >= length)
+            {
+                wellFormed = false; // timestamp without message
+                break;
+            }
+
+            // status
+            byte status = buffer[i];
+            if (status >= MIDI_TYPE)
+            {
+                i++;
+                if (status < SystemExclusive) // System Messages must not be RunningStatus
+                    previousStatus = status;
             }
+            else if (previousStatus != InvalidType)
+                status = previousStatus; // runningStatus, after a timestamp
             else
             {
-#ifndef RUNNING_ENABLE
-                auto midiType = lastStatus & 0xF0;
-                switch (midiType)
-                {
-                case NoteOff:
-                case NoteOn:
-                case AfterTouchPoly:
-                case ControlChange:
-                case PitchBend:
-                    //3 bytes full Midi -> 2 bytes runningStatus
-                    for (auto i = lPtr; i <= rPtr; i = i + 2)
-                    {
-                        mBleClass.add(lastStatus);
-                        mBleClass.add(buffer[i]);
-                        mBleClass.add(buffer[i + 1]);
-                    }
-                    break;
-                case ProgramChange:
-                case AfterTouchChannel:
-                    //2 bytes full Midi -> 1 byte runningStatus
-                    for (auto i = lPtr; i <= rPtr; i = i + 1)
-                    {
-                        mBleClass.add(lastStatus);
-                        mBleClass.add(buffer[i]);
-                    }
-                    break;
-
-                default:
-                    break;
-                }
-#else
-                mBleClass.add(lastStatus);
-                for (auto i = lPtr; i <= rPtr; i++)
-                    mBleClass.add(buffer[i]);
-#endif
-                runningStatusContinuation = false;
+                wellFormed = false; // Status message not present and it is not a runningStatus continuation, bail
+                break;
             }
 
-            if (++rPtr >= length)
-                return; // end of packet
+            // latency probes are handled here, not passed on
+            if (status == SystemExclusiveStart && mLatencyProbe.receive(buffer, length, i, setMidiTimestamp(timestampHigh, timestampByte)))
+                continue;
 
-            if (lastStatus < SystemExclusive) //exclude System Message. They must not be RunningStatus
-            {
-                previousStatus = lastStatus;
-            }
+            if (!roomForMessage(buffer, length, i, status, 1))
+                continue;
+
+            add(status);
 
-            timestampByte = buffer[rPtr++];
-            if (timestampByte >= MIDI_TYPE) // is bit 7 set?
+            // data, see _Settings::RxRunningStatus
+            auto count = addData(buffer, length, i, status, _Settings::RxRunningStatus ? 0 : dataLength[status >> 4]);
+
+            // a channel status with more data bytes is followed by runningStatus messages
+            auto n = dataLength[status >> 4];
+            messages += (n > 0 && count > n) ? count / n : 1;
+        }
+
+        mStatistics.messagesDecoded(messages);
+        return wellFormed;
+    }
+
+    // Adds the data bytes up to the next byte with bit 7 set. With a messageLength,
+    // the status is repeated for every message (runningStatus to full MIDI messages).
+    // Returns the number of data bytes.
+    size_t addData(byte *buffer, size_t length, size_t &i, byte status, byte messageLength)
+    {
+        auto start = i;
+        byte count = 0;
+        while (i < length && buffer[i] < MIDI_TYPE)
+        {
+            if (messageLength > 0 && count == messageLength)
             {
-                timestamp = setMidiTimestamp(headerByte, timestampByte);
-                // what do to with the timestamp?
+                add(status);
+                count = 0;
             }
 
-            // Point to next status
-            lPtr = rPtr;
-            if (lPtr >= length)
-                return; //end of packet
+            add(buffer[i++]);
+            count++;
         }
+        return i - start;
     }
+
+    // Data bytes of a channel message, by status (upper nibble).
+    // 0: data runs up to the next status (System Messages, SysEx)
+    static constexpr byte dataLength[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                            2, 2, 2, 2, 1, 1, 2, 0};
 };
 
+template <class T, class _Settings>
+constexpr byte BLEMIDI_Transport<T, _Settings>::dataLength[16];
+
 struct MySettings : public MIDI_NAMESPACE::DefaultSettings
 {
     static const bool Use1ByteParsing = false;
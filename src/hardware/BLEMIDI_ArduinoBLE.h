@@ -2,76 +2,23 @@
 
 #include <ArduinoBLE.h>
 
-#define BLE_POLLING
+#include "../BLEMIDI_RingBuffer.h"
 
 BEGIN_BLEMIDI_NAMESPACE
 
-BLEService midiService(SERVICE_UUID);
-
-BLEStringCharacteristic midiChar(CHARACTERISTIC_UUID,  // standard 16-bit characteristic UUID
-    BLERead | BLEWrite | BLENotify | BLEWriteWithoutResponse, 16); // remote clients will be able to get notifications if this characteristic changes
-
-template<typename T, int rawSize>
-class Fifo {
-public:
-    const size_t size; // speculative feature, in case it's needed
-
-    Fifo() : size(rawSize)
-    {
-        flush();
-    }
-
-    T dequeue()
-    {
-        numberOfElements--;
-        nextOut %= size;
-        return raw[nextOut++];
-    };
-
-    bool enqueue(T element)
-    {
-        if (count() >= rawSize)
-            return false;
-
-        numberOfElements++;
-        nextIn %= size;
-        raw[nextIn] = element;
-        nextIn++; // advance to next index
-
-        return true;
-    };
-
-    T peek() const
-    {
-        return raw[nextOut % size];
-    }
-
-    void flush()
-    {
-        nextIn = nextOut = numberOfElements = 0;
-    }
-
-    // how many elements are currently in the FIFO?
-    size_t count() { return numberOfElements; }
-
-private:
-    size_t numberOfElements;
-    size_t nextIn;
-    size_t nextOut;
-    T raw[rawSize];
-};
-
 template <class _Settings>
 class BLEMIDI_ArduinoBLE
 {
 private:
     BLEMIDI_Transport<class BLEMIDI_ArduinoBLE<_Settings>, _Settings> *_bleMidiTransport;
-    BLEDevice *_central;
 
     BLEService _midiService;
     BLECharacteristic _midiChar;
 
-    Fifo<byte, _Settings::MaxBufferSize> mRxBuffer;
+    // decoded from within BLE.poll(), read by the loop: both on the loop task, used as a plain FIFO
+    SpscRingBuffer<byte, _Settings::RxRingBufferSize> mRxBuffer;
+
+    unsigned long mLastPoll = 0;
 
     static BLEMIDI_ArduinoBLE<_Settings>* self;
 
@@ -88,43 +35,100 @@ public:
     {
     }
 
-    void write(uint8_t *buffer, size_t length)
+    bool write(uint8_t *buffer, size_t length)
     {
-        if (length > 0)
-            ((BLECharacteristic)_midiChar).writeValue(buffer, length);
+        // a sketch that only sends keeps the stack running too
+        if (_Settings::UseBLEPoll)
+            pollIfDue(false);
+
+        // straight into the value of our characteristic, notified to the central
+        if (length > 0 && _midiChar.writeValue(buffer, length))
+            return true;
+
+        _bleMidiTransport->statistics().txFailed();
+        return false;
+    }
+
+    // writeValue() waits for the controller, so there is room once the central subscribed
+    size_t txCredits()
+    {
+        return _midiChar.subscribed() ? _Settings::TxCredits : 0;
     }
 
     bool available(byte *pvBuffer)
     {
-        if (mRxBuffer.count() > 0)
+        if (mRxBuffer.pop(*pvBuffer))
         {
-            *pvBuffer = mRxBuffer.dequeue();
+            // while a large receive is drained, the stack keeps running as well
+            if (_Settings::UseBLEPoll)
+                pollIfDue(false);
             return true;
         }
 
-        if (_midiChar.written())
-        {
-            auto length = _midiChar.valueLength();
-            if (length > 0)
-            {
-                auto buffer = _midiChar.value();
-                _bleMidiTransport->receive((byte *)buffer, length);
-            }
-        }
-        return false;
+        // all is read: the packets that arrived since are decoded in BLE.poll()
+        if (_Settings::UseBLEPoll)
+            pollIfDue(true);
+
+        return mRxBuffer.pop(*pvBuffer);
     }
 
-    void add(byte value)
+    // runs the stack: connection events, and the packets received since the last call
+    void poll()
+    {
+        mLastPoll = millis();
+        BLE.poll();
+    }
+
+    // every BLEPollInterval ms, but not for every byte (or packet) while there is more to do
+    void pollIfDue(bool idle)
+    {
+        unsigned long elapsed = millis() - mLastPoll;
+        if (elapsed >= _Settings::BLEPollInterval && (idle || elapsed > 0))
+            poll();
+    }
+
+    bool add(byte value)
     {
         // called from BLE-MIDI, to add it to a buffer here
-        mRxBuffer.enqueue(value);
+        return mRxBuffer.push(value);
+    }
+
+    // RX overflow policies (see _Settings::RxOverflow)
+
+    // single threaded: both ends of the ring are ours
+    bool peekOldest(byte *value)
+    {
+        mRxBuffer.commit();
+        return mRxBuffer.peek(*value);
+    }
+
+    bool popOldest(byte *value)
+    {
+        mRxBuffer.commit();
+        bool popped = mRxBuffer.pop(*value);
+        mRxBuffer.release();
+        return popped;
+    }
+
+    bool rxWait()
+    {
+        return false; // polled from the loop, nobody makes room while we wait
+    }
+
+    size_t rxFree()
+    {
+        return mRxBuffer.space();
     }
 
 protected:
     void receive(const unsigned char *buffer, size_t length)
     {
         if (length > 0)
+        {
             _bleMidiTransport->receive((uint8_t *)buffer, length);
+            mRxBuffer.commit();
+            _bleMidiTransport->statistics().rxQueued(mRxBuffer.used());
+        }
     }
 
     void connected()
@@ -149,10 +153,9 @@ protected:
         self->disconnected();
     }
     
-    static void switchCharacteristicWritten(BLEDevice central, BLECharacteristic characteristic) {
-//        std::string rxValue = characteristic->value();
-//        if (rxValue.length() > 0)
-//            receive((uint8_t *)(rxValue.c_str()), rxValue.length());
+    static void midiCharacteristicWritten(BLEDevice central, BLECharacteristic characteristic) {
+        // the value of our own characteristic, no copy of it
+        self->receive(self->_midiChar.value(), self->_midiChar.valueLength());
     }
 };
 
@@ -165,6 +168,10 @@ bool BLEMIDI_ArduinoBLE<_Settings>::begin(const char *deviceName, BLEMIDI_Transp
 {
     _bleMidiTransport = bleMidiTransport;
 
+    // ArduinoBLE does not tell the MTU a central negotiated: stay within the default ATT_MTU of 23,
+    // so no central gets a truncated notification
+    _bleMidiTransport->setMtu(23);
+
     // initialize the Bluetooth® Low Energy hardware
     if (!BLE.begin())
         return false;
@@ -178,7 +185,7 @@ bool BLEMIDI_ArduinoBLE<_Settings>::begin(const char *deviceName, BLEMIDI_Transp
     BLE.setEventHandler(BLEConnected, blePeripheralConnectedHandler);
     BLE.setEventHandler(BLEDisconnected, blePeripheralDisconnectedHandler);
 
-    _midiChar.setEventHandler(BLEWritten, switchCharacteristicWritten);
+    _midiChar.setEventHandler(BLEWritten, midiCharacteristicWritten);
 
     // set the initial value for the characeristic:
     // (when not set, the device will disconnect after 0.5 seconds)
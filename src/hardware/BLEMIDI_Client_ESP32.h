@@ -11,6 +11,9 @@
 // Headers for ESP32 nimBLE
 #include <NimBLEDevice.h>
 
+#include "../BLEMIDI_RingBuffer.h"
+#include "../BLEMIDI_RxMerge.h"
+
 BEGIN_BLEMIDI_NAMESPACE
 
 using PasskeyRequestCallback = uint32_t (*)(void);
@@ -121,6 +124,27 @@ struct DefaultSettingsClient : public BLEMIDI_NAMESPACE::DefaultSettings
      */
     static const bool forceNewConnection = false;
 
+    /*
+    ###### BLE DIRECT RECONNECTION ######
+    */
+
+    /**
+     * After a server disconnects (e.g. it browned out), connect to its address directly, instead of waiting
+     * until a scan sees its advertisement again. Servers bonded before are tried the same way after begin().
+     * Attempts are retried with exponential backoff: reconnectDelay ms, doubled after every failed attempt,
+     * up to reconnectMaxDelay ms. After reconnectAttempts failed attempts, it falls back to scanning.
+     * The attempts run in a task of their own (reconnectTaskPriority, reconnectTaskStackSize): one takes up
+     * to reconnectTimeout seconds when the server is not there, MIDI.read() keeps reading the other servers.
+     * The time to reconnect is reported by setHandleReconnected() of the backend (from MIDI.read()).
+     */
+    static const bool directReconnect = false;
+    static const uint8_t reconnectAttempts = 6;
+    static const uint16_t reconnectDelay = 50;     // ms
+    static const uint16_t reconnectMaxDelay = 1000; // ms
+    static const uint8_t reconnectTimeout = 1;     // seconds
+    static const unsigned reconnectTaskPriority = 1;
+    static const unsigned reconnectTaskStackSize = 4096; // bytes
+
     /*
     ###### BLE SUBSCRIPTION: NOTIFICATION & RESPONSE ######
     */
@@ -165,6 +189,13 @@ protected:
         }
 
         DEBUGCLIENT("Found MIDI Service");
+        auto client = NimBLEDevice::getClientByPeerAddress(advertisedDevice->getAddress());
+        if (client && client->isConnected())
+        {
+            DEBUGCLIENT("Already connected");
+            return;
+        }
+
         if (!(!specificTarget || (advertisedDevice->getName() == nameTarget.c_str() || advertisedDevice->getAddress() == nameTarget)))
         {
             DEBUGCLIENT("Name error");
@@ -189,22 +220,82 @@ void scanEndedCB(NimBLEScanResults results);
 template <class _Settings>
 class BLEMIDI_Client_ESP32
 {
+    static_assert(_Settings::MaxConnections <= NIMBLE_MAX_CONNECTIONS, "MaxConnections is limited by NIMBLE_MAX_CONNECTIONS");
+    // the jitter buffer correlates the clock of a single sender
+    static_assert(!_Settings::UsePlayout || _Settings::MaxConnections == 1, "UsePlayout needs MaxConnections == 1");
+
+    // The bytes of several servers are only kept apart when every packet is published as a whole,
+    // so the loop task never finds (and leaves) a half message: the ring does that, the queue does not.
+    static const bool RxRing = _Settings::UseRxRingBuffer || _Settings::MaxConnections > 1;
+
+    // only the loop task may take bytes out of the ring
+    static_assert(!RxRing || _Settings::RxOverflow != RxDropOldest, "RxDropOldest does not work with UseRxRingBuffer (or MaxConnections > 1)");
+
+    template <class> friend class BLEMIDI_RxMerge;
+
+public:
+    // connection handle that addresses all connected servers (setTxConnection)
+    static const uint16_t AllConnections = BLE_HS_CONN_HANDLE_NONE;
+
 private:
-    BLEClient *_client = nullptr;
+    // one per server (up to _Settings::MaxConnections), each with its own subscription and RX stream
+    struct Server
+    {
+        BLEClient *client = nullptr;
+        BLERemoteCharacteristic *characteristic = nullptr;
+        uint16_t handle = AllConnections;
+        bool firstTimeSend = true; //First writeValue get sends like Write with reponse for clean security flags. After first time, all messages are send like WriteNoResponse for increase transmision speed.
+        QueueHandle_t rxQueue;
+        char connectedDeviceName[24];
+
+        // only sized when RxRing is set
+        SpscRingBuffer<byte, (RxRing ? _Settings::RxRingBufferSize : 1)> rxRing;
+
+        // disconnected: what is left in the RX stream is thrown away by the loop task
+        volatile bool rxStale = false;
+
+        // direct reconnection (_Settings::directReconnect)
+        NimBLEAddress address;
+        bool subscribed = false; // to address, so it is worth reconnecting
+        volatile bool reconnecting = false;
+        uint8_t reconnectFailures = 0;
+        unsigned long reconnectAt = 0; // millis() of the next attempt
+        unsigned long disconnectedAt = 0;
+        unsigned long reconnectedAt = 0;
+        volatile bool reconnectDone = false; // to be reported by the loop task
+
+        bool isConnected()
+        {
+            return client && client->isConnected() && characteristic;
+        }
+    };
+
+    Server mServers[_Settings::MaxConnections];
+
     BLEAdvertising *_advertising = nullptr;
-    BLERemoteCharacteristic *_characteristic = nullptr;
-    BLERemoteService *pSvc = nullptr;
-    bool firstTimeSend = true; //First writeValue get sends like Write with reponse for clean security flags. After first time, all messages are send like WriteNoResponse for increase transmision speed.
-    char connectedDeviceName[24];
     
-    BLEMIDI_Transport<class BLEMIDI_Client_ESP32> *_bleMidiTransport = nullptr;
+    BLEMIDI_Transport<class BLEMIDI_Client_ESP32<_Settings>, _Settings> *_bleMidiTransport = nullptr;
 
     bool specificTarget = false;
 
     AdvertisedDeviceCallbacks myAdvCB;
 
+public:
+    // called with the time from the disconnect (or begin()) to the direct reconnection, in ms
+    using ReconnectedCallback = void (*)(uint16_t handle, unsigned long milliseconds);
+
+private:
+    ReconnectedCallback mReconnectedCallback = nullptr;
+
+    // direct reconnection runs in a task of its own, a connection is made by one task at a time
+    TaskHandle_t mReconnectTask = nullptr;
+    SemaphoreHandle_t mConnectLock = nullptr;
+
 protected:
-    QueueHandle_t mRxQueue;
+    unsigned mAddSlot = 0;  // BLE task: server of the packet being decoded
+    BLEMIDI_RxMerge<_Settings> mRxMerge; // loop task: server being read
+    uint16_t mRxConnection = AllConnections;
+    uint16_t mTxConnection = AllConnections;
 
 public:
     BLEMIDI_Client_ESP32()
@@ -216,72 +307,319 @@ public:
     bool end()
     {
         myAdvCB.enableConnection = false;
-        xQueueReset(mRxQueue);
-        _client->disconnect();
-        _client = nullptr;
+        for (auto &server : mServers)
+        {
+            if (RxRing)
+                server.rxStale = true;
+            else
+                xQueueReset(server.rxQueue);
+            if (server.client)
+                server.client->disconnect();
+            server.client = nullptr;
+            server.characteristic = nullptr;
+        }
 
         return true;
     }
 
-    void write(uint8_t *data, uint8_t length)
+    // true when (at least) one server took the packet
+    bool write(uint8_t *data, size_t length)
     {
         if (!myAdvCB.enableConnection)
-            return;
-        if (_characteristic == NULL)
-            return;
-
-        if (firstTimeSend)
-        {
-            _characteristic->writeValue(data, length, true);
-            firstTimeSend = false;
-            return;
-        }
+            return false;
 
-        if (!_characteristic->writeValue(data, length, !_characteristic->canWriteNoResponse()))
-            firstTimeSend = true;
+        bool sent = false;
+        for (auto &server : mServers)
+            if (server.isConnected() && (mTxConnection == AllConnections || mTxConnection == server.handle))
+                sent |= write(server, data, length);
+        return sent;
+    }
 
-        return;
+    // packets the next write()s can hand over without the stack running out of buffers
+    size_t txCredits()
+    {
+        unsigned servers = 0;
+        for (auto &server : mServers)
+            if (server.isConnected() && (mTxConnection == AllConnections || mTxConnection == server.handle))
+                servers++;
+        if (!myAdvCB.enableConnection || servers == 0)
+            return 0;
+
+        // a write without response holds an mbuf of the msys pool until the controller has sent it
+        size_t credits = os_msys_num_free() / servers;
+        return credits < _Settings::TxCredits ? credits : _Settings::TxCredits;
     }
 
     bool available(byte *pvBuffer);
 
-    void add(byte value)
+    bool add(byte value)
     {
         // called from BLE-MIDI, to add it to a buffer here
-        xQueueSend(mRxQueue, &value, portMAX_DELAY / 2);
+        auto &server = mServers[mAddSlot];
+
+        if (RxRing)
+            return server.rxRing.push(value);
+
+        return xQueueSend(server.rxQueue, &value, 0); // never block the BLE task, see rxWait
+    }
+
+    // RX overflow policies (see _Settings::RxOverflow)
+
+    // (not with the ring, see static_assert)
+    bool peekOldest(byte *value)
+    {
+        return !RxRing && xQueuePeek(mServers[mAddSlot].rxQueue, value, 0);
+    }
+
+    bool popOldest(byte *value)
+    {
+        return !RxRing && xQueueReceive(mServers[mAddSlot].rxQueue, value, 0);
+    }
+
+    bool rxWait()
+    {
+        // hand over what we have and let the loop task make room
+        // (with several servers only whole packets, the loop task makes room with what it has)
+        if (RxRing && _Settings::MaxConnections == 1)
+            mServers[mAddSlot].rxRing.commit();
+        vTaskDelay(1);
+        return true;
+    }
+
+    size_t rxFree()
+    {
+        auto &server = mServers[mAddSlot];
+
+        if (RxRing)
+            return server.rxRing.space();
+
+        return uxQueueSpacesAvailable(server.rxQueue);
+    }
+
+    // connection handle of the server that sent the bytes being read (e.g. in a MIDI callback)
+    uint16_t getRxConnection()
+    {
+        return mRxConnection;
+    }
+
+    // send to a single server, or to AllConnections (default)
+    void setTxConnection(uint16_t handle)
+    {
+        if (handle == mTxConnection)
+            return;
+
+        _bleMidiTransport->flush(); // pending messages go to the previous destination
+        mTxConnection = handle;
+    }
+
+    unsigned connectionCount()
+    {
+        unsigned count = 0;
+        for (auto &server : mServers)
+            if (server.isConnected())
+                count++;
+        return count;
+    }
+
+    // see _Settings::directReconnect
+    void setHandleReconnected(ReconnectedCallback fptr)
+    {
+        mReconnectedCallback = fptr;
     }
 
 protected:
+    bool write(Server &server, uint8_t *data, size_t length)
+    {
+        if (server.firstTimeSend)
+        {
+            server.firstTimeSend = false;
+            if (server.characteristic->writeValue(data, length, true))
+                return true;
+
+            _bleMidiTransport->statistics().txFailed();
+            return false;
+        }
+
+        if (server.characteristic->writeValue(data, length, !server.characteristic->canWriteNoResponse()))
+            return true;
+
+        _bleMidiTransport->statistics().txFailed();
+        server.firstTimeSend = true;
+        return false;
+    }
+
     void receive(uint8_t *buffer, size_t length)
     {
         // forward the buffer so that it can be parsed
         _bleMidiTransport->receive(buffer, length);
+
+        // publish all messages of this packet at once
+        auto &server = mServers[mAddSlot];
+        if (RxRing)
+        {
+            server.rxRing.commit();
+            _bleMidiTransport->statistics().rxQueued(server.rxRing.used());
+        }
+        else
+            _bleMidiTransport->statistics().rxQueued(uxQueueMessagesWaiting(server.rxQueue));
+    }
+
+    bool pop(Server &server, byte *value)
+    {
+        if (RxRing)
+            return server.rxRing.pop(*value);
+
+        return xQueueReceive(server.rxQueue, (void *)value, 0); // return immediately when the queue is empty
+    }
+
+    // RX streams, for mRxMerge
+    bool rxPop(unsigned slot, byte *value)
+    {
+        return pop(mServers[slot], value);
+    }
+
+    bool rxConnected(unsigned slot)
+    {
+        return mServers[slot].isConnected();
+    }
+
+    bool rxStale(unsigned slot)
+    {
+        return mServers[slot].rxStale;
+    }
+
+    void rxClearStale(unsigned slot)
+    {
+        mServers[slot].rxStale = false;
+    }
+
+    // all packets must fit every server
+    void updateMtu()
+    {
+        uint16_t mtu = 0;
+        for (auto &server : mServers)
+            if (server.isConnected() && (mtu == 0 || server.client->getMTU() < mtu))
+                mtu = server.client->getMTU();
+
+        if (mtu)
+            _bleMidiTransport->setMtu(mtu);
+    }
+
+    Server *findServer(BLEClient *client)
+    {
+        for (auto &server : mServers)
+            if (server.client == client)
+                return &server;
+        return nullptr;
     }
 
     void notifyCB(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify);
 
     void scan();
     bool connect();
+    bool connect(Server &server, const NimBLEAddress &address, uint8_t timeout);
+    bool subscribe(Server &server);
+
+    void startReconnect(Server &server)
+    {
+        server.reconnectFailures = 0;
+        server.disconnectedAt = server.reconnectAt = millis();
+        server.reconnecting = true;
+        if (mReconnectTask)
+            xTaskNotifyGive(mReconnectTask);
+    }
+
+    static void reconnectTask(void *parameter)
+    {
+        auto self = static_cast<BLEMIDI_Client_ESP32 *>(parameter);
+        for (;;)
+        {
+            // woken by startReconnect, or when the next backoff may be due
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(_Settings::reconnectDelay));
+            self->reconnect();
+        }
+    }
+
+    void reconnect();
+
+    // (any task) reported from the loop task, see reportReconnected
+    void reconnected(Server &server)
+    {
+        server.reconnectedAt = millis();
+        server.reconnecting = false;
+        server.reconnectDone = true;
+    }
+
+    void reportReconnected()
+    {
+        for (auto &server : mServers)
+        {
+            if (!server.reconnectDone)
+                continue;
+
+            server.reconnectDone = false;
+            if (mReconnectedCallback)
+                mReconnectedCallback(server.handle, server.reconnectedAt - server.disconnectedAt);
+        }
+    }
+
+    unsigned reconnectingCount()
+    {
+        unsigned count = 0;
+        for (auto &server : mServers)
+            if (server.reconnecting)
+                count++;
+        return count;
+    }
 
 public:
-    void connected()
+    void connected(BLEClient *client)
     {
+        auto server = findServer(client);
+        if (server)
+            server->firstTimeSend = true;
+
         if (_bleMidiTransport->_connectedCallback)
             _bleMidiTransport->_connectedCallback();
-        firstTimeSend = true;
         
-        if (_bleMidiTransport->_connectedCallbackDeviceName)
+        // a direct reconnection has no advertisement, it keeps the name of the last connection
+        if (server && myAdvCB.advDevice.getAddress() == client->getPeerAddress() && _bleMidiTransport->_connectedCallbackDeviceName)
         {
-            sprintf(connectedDeviceName, "%s", myAdvCB.advDevice.getName().c_str());
-            _bleMidiTransport->_connectedCallbackDeviceName(connectedDeviceName);
+            sprintf(server->connectedDeviceName, "%s", myAdvCB.advDevice.getName().c_str());
+            _bleMidiTransport->_connectedCallbackDeviceName(server->connectedDeviceName);
         }
     }
 
-    void disconnected()
+    void disconnected(BLEClient *client)
     {
+        auto server = findServer(client);
+        if (server)
+        {
+            server->firstTimeSend = true;
+
+            // not to be read as the bytes of the next server in this slot
+            if (!RxRing)
+                xQueueReset(server->rxQueue);
+            server->rxStale = true;
+
+            if (mTxConnection == server->handle)
+                mTxConnection = AllConnections;
+
+            if (_Settings::forceNewConnection)
+            {
+                // the client is deleted (MyClientCallbacks::onDisconnect)
+                server->client = nullptr;
+                server->characteristic = nullptr;
+            }
+
+            // connect to it again by its address (not after end(), nor after a failed attempt)
+            if (_Settings::directReconnect && myAdvCB.enableConnection && server->subscribed && !server->reconnecting)
+                startReconnect(*server);
+            server->subscribed = false;
+        }
+
         if (_bleMidiTransport->_disconnectedCallback)
             _bleMidiTransport->_disconnectedCallback();
-        firstTimeSend = true;
     }
 };
 
@@ -311,7 +649,7 @@ protected:
         // pClient->updateConnParams(_Settings::commMinInterval, _Settings::commMaxInterval, _Settings::commLatency, _Settings::commTimeOut);
         vTaskDelay(1);
         if (_bluetoothEsp32)
-            _bluetoothEsp32->connected();
+            _bluetoothEsp32->connected(pClient);
     };
 
     void onDisconnect(BLEClient *pClient)
@@ -321,7 +659,7 @@ protected:
 
         if (_bluetoothEsp32)
         {
-            _bluetoothEsp32->disconnected();
+            _bluetoothEsp32->disconnected(pClient);
         }
 
         if (_Settings::forceNewConnection)
@@ -331,8 +669,9 @@ protected:
             pClient = nullptr;
         }
 
-        // Try reconnection or search a new one
-        NimBLEDevice::getScan()->start(1, scanEndedCB);
+        // Try reconnection or search a new one (directReconnect: see BLEMIDI_Client_ESP32::reconnect)
+        if (!_Settings::directReconnect)
+            NimBLEDevice::getScan()->start(1, scanEndedCB);
     }
 
     bool onConnParamsUpdateRequest(NimBLEClient *pClient, const ble_gap_upd_params *params)
@@ -392,7 +731,9 @@ bool BLEMIDI_Client_ESP32<_Settings>::begin(const char *deviceName, BLEMIDI_Tran
 
     // To communicate between the 2 cores.
     // Core_0 runs here, core_1 runs the BLE stack
-    mRxQueue = xQueueCreate(_Settings::MaxBufferSize, sizeof(uint8_t));
+    if (!RxRing)
+        for (auto &server : mServers)
+            server.rxQueue = xQueueCreate(_Settings::MaxBufferSize, sizeof(uint8_t));
 
     NimBLEDevice::setSecurityIOCap(_Settings::clientSecurityCapabilities); // Attention, it may need a passkey
     NimBLEDevice::setSecurityAuth(_Settings::clientBond, _Settings::clientMITM, _Settings::clientPair);
@@ -401,6 +742,25 @@ bool BLEMIDI_Client_ESP32<_Settings>::begin(const char *deviceName, BLEMIDI_Tran
     NimBLEDevice::setPower(_Settings::clientTXPwr); /** +9db */
 
     myAdvCB.enableConnection = true;
+
+    if (_Settings::directReconnect)
+    {
+        mConnectLock = xSemaphoreCreateMutex();
+        xTaskCreate(reconnectTask, "BLEMIDI reconnect", _Settings::reconnectTaskStackSize, this, _Settings::reconnectTaskPriority, &mReconnectTask);
+
+        // servers bonded before are connected directly, without waiting for their advertisement
+        unsigned slot = 0;
+        for (int i = 0; i < NimBLEDevice::getNumBonds() && slot < _Settings::MaxConnections; i++)
+        {
+            auto address = NimBLEDevice::getBondedAddress(i);
+            if (myAdvCB.specificTarget && !(address == myAdvCB.nameTarget))
+                continue;
+
+            mServers[slot].address = address;
+            startReconnect(mServers[slot++]);
+        }
+    }
+
     scan();
 
     return true;
@@ -414,8 +774,11 @@ bool BLEMIDI_Client_ESP32<_Settings>::available(byte *pvBuffer)
         return false;
     }
 
-    // Try to connect/reconnect
-    if (_client == nullptr || !_client->isConnected())
+    if (_Settings::directReconnect)
+        reportReconnected();
+
+    // Try to connect/reconnect, while there is room for another server
+    if (connectionCount() + reconnectingCount() < _Settings::MaxConnections)
     {
         if (myAdvCB.doConnect)
         {
@@ -431,17 +794,26 @@ bool BLEMIDI_Client_ESP32<_Settings>::available(byte *pvBuffer)
         }
     }
 
-    // return 1 byte from the Queue
-    return xQueueReceive(mRxQueue, (void *)pvBuffer, 0); // return immediately when the queue is empty
+    // the streams of the servers, one after the other (see BLEMIDI_RxMerge)
+    if (!mRxMerge.available(*this, pvBuffer))
+        return false;
+
+    mRxConnection = mServers[mRxMerge.slot()].handle;
+    return true;
 }
 
 /** Notification receiving handler callback */
 template <class _Settings>
 void BLEMIDI_Client_ESP32<_Settings>::notifyCB(NimBLERemoteCharacteristic *pRemoteCharacteristic, uint8_t *pData, size_t length, bool isNotify)
 {
-    if (this->_characteristic == pRemoteCharacteristic) // Redundant protection
+    for (unsigned i = 0; i < _Settings::MaxConnections; i++)
     {
-        receive(pData, length);
+        if (mServers[i].characteristic == pRemoteCharacteristic)
+        {
+            mAddSlot = i;
+            receive(pData, length);
+            return;
+        }
     }
 }
 
@@ -466,10 +838,100 @@ void BLEMIDI_Client_ESP32<_Settings>::scan()
 };
 
 template <class _Settings>
-bool BLEMIDI_Client_ESP32<_Settings>::connect()
+bool BLEMIDI_Client_ESP32<_Settings>::subscribe(Server &server)
 {
     using namespace std::placeholders; //<- for bind funtion in callback notification
 
+    if (server.characteristic->canNotify())
+    {
+        if (server.characteristic->subscribe(_Settings::notification, std::bind(&BLEMIDI_Client_ESP32::notifyCB, this, _1, _2, _3, _4), _Settings::response))
+        {
+            server.handle = server.client->getConnId();
+            server.address = server.client->getPeerAddress(); // for directReconnect
+            server.subscribed = true;
+            updateMtu(); // exchanged by NimBLE when connecting
+            return true;
+        }
+    }
+    return false;
+}
+
+// reconnect task
+template <class _Settings>
+void BLEMIDI_Client_ESP32<_Settings>::reconnect()
+{
+    for (auto &server : mServers)
+    {
+        if (!myAdvCB.enableConnection)
+            return;
+        if (!server.reconnecting || (long)(millis() - server.reconnectAt) < 0)
+            continue;
+
+        xSemaphoreTake(mConnectLock, portMAX_DELAY);
+        // (it may have come back through its advertisement, while we waited)
+        bool connected = server.reconnecting && connect(server, server.address, _Settings::reconnectTimeout);
+        xSemaphoreGive(mConnectLock);
+
+        if (connected)
+        {
+            reconnected(server);
+            continue;
+        }
+        if (!server.reconnecting)
+            continue;
+
+        if (++server.reconnectFailures >= _Settings::reconnectAttempts)
+        {
+            // give up, wait for its advertisement (scanned from the loop task)
+            server.reconnecting = false;
+            myAdvCB.scanDone = true;
+            continue;
+        }
+
+        // exponential backoff
+        unsigned long delay = _Settings::reconnectDelay;
+        for (uint8_t i = 1; i < server.reconnectFailures && delay < _Settings::reconnectMaxDelay; i++)
+            delay *= 2;
+        server.reconnectAt = millis() + (delay < _Settings::reconnectMaxDelay ? delay : _Settings::reconnectMaxDelay);
+    }
+}
+
+template <class _Settings>
+bool BLEMIDI_Client_ESP32<_Settings>::connect()
+{
+    // A server seen before gets its own slot back, otherwise take a free one
+    Server *server = nullptr;
+    for (auto &s : mServers)
+        if ((s.client && s.client->getPeerAddress() == myAdvCB.advDevice.getAddress()) ||
+            (s.reconnecting && s.address == myAdvCB.advDevice.getAddress()))
+            server = &s;
+    for (auto &s : mServers)
+        if (!server && !s.isConnected() && !s.reconnecting)
+            server = &s;
+    if (!server)
+        return false;
+
+    // the reconnect task is at it, try again with the next advertisement
+    if (mConnectLock && xSemaphoreTake(mConnectLock, 0) != pdTRUE)
+        return false;
+
+    bool connected = connect(*server, myAdvCB.advDevice.getAddress(), 15);
+    if (mConnectLock)
+        xSemaphoreGive(mConnectLock);
+    if (!connected)
+        return false;
+
+    if (server->reconnecting)
+        reconnected(*server); // through its advertisement, before a direct attempt made it
+    return true;
+}
+
+template <class _Settings>
+bool BLEMIDI_Client_ESP32<_Settings>::connect(Server &server, const NimBLEAddress &address, uint8_t timeout)
+{
+    auto &_client = server.client;
+    auto &_characteristic = server.characteristic;
+
     // Retry to connecto to last one
     if (!_Settings::forceNewConnection)
     {
@@ -480,17 +942,15 @@ bool BLEMIDI_Client_ESP32<_Settings>::connect()
 
         if (_client)
         {
-            if (_client == NimBLEDevice::getClientByPeerAddress(myAdvCB.advDevice.getAddress()))
+            if (_client == NimBLEDevice::getClientByPeerAddress(address) && _characteristic)
             {
-                if (_client->connect(&myAdvCB.advDevice, false))
+                _client->setConnectTimeout(timeout);
+                if (_client->connect(address, false))
                 {
-                    if (_characteristic->canNotify())
+                    if (subscribe(server))
                     {
-                        if (_characteristic->subscribe(_Settings::notification, std::bind(&BLEMIDI_Client_ESP32::notifyCB, this, _1, _2, _3, _4), _Settings::response))
-                        {
-                            // Re-connection SUCCESS
-                            return true;
-                        }
+                        // Re-connection SUCCESS
+                        return true;
                     }
                     /** Disconnect if subscribe failed */
                     _client->disconnect();
@@ -498,11 +958,13 @@ bool BLEMIDI_Client_ESP32<_Settings>::connect()
                 /* If any connection problem exits, delete previous client and try again in the next attemp as new client*/
                 NimBLEDevice::deleteClient(_client);
                 _client = nullptr;
+                _characteristic = nullptr;
                 return false;
             }
             /*If client does not match, delete previous client and create a new one*/
             NimBLEDevice::deleteClient(_client);
             _client = nullptr;
+            _characteristic = nullptr;
         }
     }
 
@@ -520,9 +982,9 @@ bool BLEMIDI_Client_ESP32<_Settings>::connect()
     _client->setConnectionParams(_Settings::commMinInterval, _Settings::commMaxInterval, _Settings::commLatency, _Settings::commTimeOut);
 
     /** Set how long we are willing to wait for the connection to complete (seconds), default is 30. */
-    _client->setConnectTimeout(15);
+    _client->setConnectTimeout(timeout);
 
-    if (!_client->connect(&myAdvCB.advDevice))
+    if (!_client->connect(address))
     {
         /** Created a client but failed to connect, don't need to keep it as it has no data */
         NimBLEDevice::deleteClient(_client);
@@ -546,20 +1008,17 @@ bool BLEMIDI_Client_ESP32<_Settings>::connect()
     DEBUGCLIENT(_client->getRssi());
 
     /** Now we can read/write/subscribe the charateristics of the services we are interested in */
-    pSvc = _client->getService(SERVICE_UUID);
+    auto pSvc = _client->getService(SERVICE_UUID);
     if (pSvc) /** make sure it's not null */
     {
         _characteristic = pSvc->getCharacteristic(CHARACTERISTIC_UUID);
 
         if (_characteristic) /** make sure it's not null */
         {
-            if (_characteristic->canNotify())
+            if (subscribe(server))
             {
-                if (_characteristic->subscribe(_Settings::notification, std::bind(&BLEMIDI_Client_ESP32::notifyCB, this, _1, _2, _3, _4), _Settings::response))
-                {
-                    // Connection SUCCESS
-                    return true;
-                }
+                // Connection SUCCESS
+                return true;
             }
         }
     }
@@ -568,6 +1027,7 @@ bool BLEMIDI_Client_ESP32<_Settings>::connect()
     _client->disconnect();
     NimBLEDevice::deleteClient(_client);
     _client = nullptr;
+    _characteristic = nullptr;
     return false;
 };
 
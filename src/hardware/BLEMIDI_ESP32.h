@@ -18,6 +18,7 @@ private:
     BLEServer *_server = nullptr;
     BLEAdvertising *_advertising = nullptr;
     BLECharacteristic *_characteristic = nullptr;
+    BLE2902 *_cccd = nullptr;
 
     BLEMIDI_Transport<class BLEMIDI_ESP32<_Settings>, _Settings>* _bleMidiTransport = nullptr;
 
@@ -39,10 +40,25 @@ public:
         Serial.println("end");
     }
 
-    void write(uint8_t *buffer, size_t length)
+    bool write(uint8_t *buffer, size_t length)
     {
+        // notify() reports no errors, it only sends when the client enabled notifications
+        if (_server->getConnectedCount() == 0 || !_cccd->getNotifications())
+            return false;
+
         _characteristic->setValue(buffer, length);
         _characteristic->notify();
+        return true;
+    }
+
+    // packets the next write()s can hand over: the free buffers Bluedroid has for the connection
+    size_t txCredits()
+    {
+        if (_server->getConnectedCount() == 0 || !_cccd->getNotifications())
+            return 0;
+
+        size_t credits = esp_ble_get_cur_sendable_packets_num(_server->getConnId());
+        return credits < _Settings::TxCredits ? credits : _Settings::TxCredits;
     }
 
     bool available(byte *pvBuffer)
@@ -50,10 +66,33 @@ public:
         return xQueueReceive(mRxQueue, pvBuffer, 0); // return immediately when the queue is empty
     }
 
-    void add(byte value)
+    bool add(byte value)
     {
         // called from BLE-MIDI, to add it to a buffer here
-        xQueueSend(mRxQueue, &value, portMAX_DELAY);
+        return xQueueSend(mRxQueue, &value, 0); // never block the BLE task, see rxWait
+    }
+
+    // RX overflow policies (see _Settings::RxOverflow)
+
+    bool peekOldest(byte *value)
+    {
+        return xQueuePeek(mRxQueue, value, 0);
+    }
+
+    bool popOldest(byte *value)
+    {
+        return xQueueReceive(mRxQueue, value, 0);
+    }
+
+    bool rxWait()
+    {
+        vTaskDelay(1); // let the loop task make room
+        return true;
+    }
+
+    size_t rxFree()
+    {
+        return uxQueueSpacesAvailable(mRxQueue);
     }
 
 protected:
@@ -61,10 +100,20 @@ protected:
     {
         // parse the incoming buffer
         _bleMidiTransport->receive(buffer, length);
+
+        _bleMidiTransport->statistics().rxQueued(uxQueueMessagesWaiting(mRxQueue));
+    }
+
+    void notifyFailed()
+    {
+        _bleMidiTransport->statistics().txFailed();
     }
 
     void connected()
     {
+        // until the central negotiates a larger MTU
+        _bleMidiTransport->setMtu(ESP_GATT_DEF_BLE_MTU_SIZE);
+
         if (_bleMidiTransport->_connectedCallback)
             _bleMidiTransport->_connectedCallback();
     }
@@ -76,6 +125,11 @@ protected:
 
         end();
     }
+
+    void mtuChanged(uint16_t mtu)
+    {
+        _bleMidiTransport->setMtu(mtu);
+    }
 };
 
 template <class _Settings>
@@ -103,6 +157,12 @@ protected:
 
         server->getAdvertising()->start();
     }
+
+    void onMtuChanged(BLEServer *, esp_ble_gatts_cb_param_t *param)
+    {
+        if (_bluetoothEsp32)
+            _bluetoothEsp32->mtuChanged(param->mtu.mtu);
+    }
 };
 
 template <class _Settings>
@@ -117,14 +177,30 @@ public:
 protected:
     BLEMIDI_ESP32<_Settings> *_bluetoothEsp32 = nullptr;
 
+    uint8_t _rxPacket[ESP_GATT_MAX_ATTR_LEN];
+
     void onWrite(BLECharacteristic *characteristic)
     {
-        auto rxValue = characteristic->getValue();
-        if (rxValue.length() > 0)
+        // Read straight from the attribute's buffer, into a preallocated packet buffer:
+        // no heap allocation in the BLE task. (The value is not decoded in place,
+        // write() sets the same characteristic from the loop task.)
+        auto length = characteristic->getLength();
+        if (length > sizeof(_rxPacket))
+            length = sizeof(_rxPacket);
+
+        if (length > 0)
         {
-            _bluetoothEsp32->receive((uint8_t *)(rxValue.c_str()), rxValue.length());
+            memcpy(_rxPacket, characteristic->getData(), length);
+            _bluetoothEsp32->receive(_rxPacket, length);
         }
     }
+
+    void onStatus(BLECharacteristic *, Status s, uint32_t)
+    {
+        // no client or notifications disabled is not a failure
+        if (s == ERROR_GATT)
+            _bluetoothEsp32->notifyFailed();
+    }
 };
 
 template <class _Settings>
@@ -152,7 +228,8 @@ inline bool BLEMIDI_ESP32<_Settings>::begin(const char *deviceName, BLEMIDI_Tran
             BLECharacteristic::PROPERTY_NOTIFY |
             BLECharacteristic::PROPERTY_WRITE_NR);
     // Add CCCD 0x2902 to allow notify
-    _characteristic->addDescriptor(new BLE2902());
+    _cccd = new BLE2902();
+    _characteristic->addDescriptor(_cccd);
 
     _characteristic->setCallbacks(new MyCharacteristicCallbacks<_Settings>(this));
 
@@ -3,11 +3,23 @@
 // Headers for ESP32 NimBLE
 #include <NimBLEDevice.h>
 
+#include "../BLEMIDI_RingBuffer.h"
+#include "../BLEMIDI_RxMerge.h"
+
 BEGIN_BLEMIDI_NAMESPACE
 
 template <class _Settings>
 class BLEMIDI_ESP32_NimBLE
 {
+    // the jitter buffer correlates the clock of a single sender
+    static_assert(!_Settings::UsePlayout || _Settings::MaxConnections == 1, "UsePlayout needs MaxConnections == 1");
+    // The bytes of several centrals are only kept apart when every packet is published as a whole,
+    // so the loop task never finds (and leaves) a half message: the ring does that, the queue does not.
+    static const bool RxRing = _Settings::UseRxRingBuffer || _Settings::MaxConnections > 1;
+
+    // only the loop task may take bytes out of the ring
+    static_assert(!RxRing || _Settings::RxOverflow != RxDropOldest, "RxDropOldest does not work with UseRxRingBuffer (or MaxConnections > 1)");
+
 private:
     BLEServer *_server = nullptr;
     BLEAdvertising *_advertising = nullptr;
@@ -17,9 +29,62 @@ private:
 
     template <class> friend class MyServerCallbacks;
     template <class> friend class MyCharacteristicCallbacks;
+    template <class> friend class BLEMIDI_RxMerge;
+
+public:
+    // connection handle that addresses all connected centrals (setTxConnection)
+    static const uint16_t AllConnections = BLE_HS_CONN_HANDLE_NONE;
 
 protected:
-    QueueHandle_t mRxQueue;
+    // one per central, a free slot has handle AllConnections
+    struct Connection
+    {
+        uint16_t handle = AllConnections;
+        uint16_t mtu = BLE_ATT_MTU_DFLT;
+
+        // notifications enabled by the central (CCCD)
+        volatile bool subscribed = false;
+
+        QueueHandle_t rxQueue;
+
+        // only sized when RxRing is set
+        SpscRingBuffer<byte, (RxRing ? _Settings::RxRingBufferSize : 1)> rxRing;
+
+        // disconnected: what is left in the RX stream is thrown away by the loop task
+        volatile bool rxStale = false;
+    };
+
+    Connection mConnections[_Settings::MaxConnections];
+
+    unsigned mAddSlot = 0;  // BLE task: connection of the packet being decoded
+    BLEMIDI_RxMerge<_Settings> mRxMerge; // loop task: connection being read
+    uint16_t mRxConnection = AllConnections;
+    uint16_t mTxConnection = AllConnections;
+
+    // a packet waiting for the TX task (_Settings::UseTxTask)
+    struct TxPacket
+    {
+        uint16_t connection;
+        uint16_t length;
+        byte data[_Settings::MaxBufferSize];
+    };
+
+    // the sender pushes, the TX task pops
+    SpscRingBuffer<TxPacket, (_Settings::UseTxTask ? _Settings::TxQueueSize : 1)> mTxQueue;
+
+    // System Real-Time, sent by the TX task ahead of what is in mTxQueue
+    struct TxRealTime
+    {
+        uint16_t connection;
+        byte data[3]; // header, timestamp, status
+    };
+    SpscRingBuffer<TxRealTime, (_Settings::UseTxTask ? 4 : 1)> mTxRealTimeQueue;
+    TaskHandle_t mTxTask = nullptr;
+
+    // traffic, for the connection interval (_Settings::UseAdaptiveInterval)
+    volatile unsigned long mLastTraffic = 0;
+    volatile bool mTrafficActive = false;
+    TimerHandle_t mIdleTimer = nullptr;
 
 public:
     BLEMIDI_ESP32_NimBLE()
@@ -32,42 +97,447 @@ public:
     {
     }
 
-    void write(uint8_t *buffer, size_t length)
+    // true when the stack took the packet. With UseTxTask the TX task counts it, once it did.
+    bool write(uint8_t *buffer, size_t length)
     {
-        _characteristic->setValue(buffer, length);
-        _characteristic->notify();
+        traffic();
+
+        if (_Settings::UseTxTask)
+        {
+            // a packet that ends in a System Real-Time status comes from the transport's writeRealTime
+            // (nothing else can end in a byte >= F8): that message takes the lane of its own,
+            // what came before it in the packet keeps its place in the queue
+            if (buffer[length - 1] >= Clock)
+            {
+                queueRealTime(buffer, length);
+                length -= 2;
+                if (length <= 1)
+                {
+                    xTaskNotifyGive(mTxTask);
+                    return false;
+                }
+            }
+
+            // only a copy here, the TX task does the rest
+            auto packet = mTxQueue.reserve();
+            if (!packet)
+            {
+                _bleMidiTransport->statistics().txDropped();
+                return false;
+            }
+
+            packet->connection = mTxConnection;
+            packet->length = length;
+            memcpy(packet->data, buffer, length);
+            mTxQueue.advance();
+            mTxQueue.commit();
+
+            xTaskNotifyGive(mTxTask);
+            return false;
+        }
+
+        return notify(buffer, length, mTxConnection, 0);
+    }
+
+    // packets the next write()s can hand over without the stack running out of buffers
+    size_t txCredits()
+    {
+        // nobody to notify
+        unsigned centrals = subscribedCount(mTxConnection);
+        if (centrals == 0)
+            return 0;
+
+        if (_Settings::UseTxTask)
+            return mTxQueue.space(); // the TX task waits for the stack, not the sender
+
+        // a notification holds an mbuf of the msys pool until the controller has sent it
+        size_t credits = os_msys_num_free() / centrals;
+        return credits < _Settings::TxCredits ? credits : _Settings::TxCredits;
     }
 
     bool available(byte *pvBuffer)
     {
-        // return 1 byte from the Queue
-        return xQueueReceive(mRxQueue, (void *)pvBuffer, 0); // return immediately when the queue is empty
+        // the streams of the centrals, one after the other (see BLEMIDI_RxMerge)
+        if (!mRxMerge.available(*this, pvBuffer))
+            return false;
+
+        mRxConnection = mConnections[mRxMerge.slot()].handle;
+        return true;
     }
 
-    void add(byte value)
+    bool add(byte value)
     {
         // called from BLE-MIDI, to add it to a buffer here
-        xQueueSend(mRxQueue, &value, portMAX_DELAY);
+        auto &connection = mConnections[mAddSlot];
+
+        if (RxRing)
+            return connection.rxRing.push(value);
+
+        return xQueueSend(connection.rxQueue, &value, 0); // never block the BLE task, see rxWait
+    }
+
+    // RX overflow policies (see _Settings::RxOverflow)
+
+    // (not with the ring, see static_assert)
+    bool peekOldest(byte *value)
+    {
+        return !RxRing && xQueuePeek(mConnections[mAddSlot].rxQueue, value, 0);
+    }
+
+    bool popOldest(byte *value)
+    {
+        return !RxRing && xQueueReceive(mConnections[mAddSlot].rxQueue, value, 0);
+    }
+
+    bool rxWait()
+    {
+        // hand over what we have and let the loop task make room
+        // (with several centrals only whole packets, the loop task makes room with what it has)
+        if (RxRing && _Settings::MaxConnections == 1)
+            mConnections[mAddSlot].rxRing.commit();
+        vTaskDelay(1);
+        return true;
+    }
+
+    size_t rxFree()
+    {
+        auto &connection = mConnections[mAddSlot];
+
+        if (RxRing)
+            return connection.rxRing.space();
+
+        return uxQueueSpacesAvailable(connection.rxQueue);
+    }
+
+    // connection handle of the central that sent the bytes being read (e.g. in a MIDI callback)
+    uint16_t getRxConnection()
+    {
+        return mRxConnection;
+    }
+
+    // send to a single central, or to AllConnections (default)
+    void setTxConnection(uint16_t handle)
+    {
+        if (handle == mTxConnection)
+            return;
+
+        _bleMidiTransport->flush(); // pending messages go to the previous destination
+        mTxConnection = handle;
+    }
+
+    unsigned connectionCount()
+    {
+        unsigned count = 0;
+        for (auto &connection : mConnections)
+            if (connection.handle != AllConnections)
+                count++;
+        return count;
+    }
+
+    // centrals that enabled notifications, for AllConnections all of them, else 0 or 1
+    unsigned subscribedCount(uint16_t handle = AllConnections)
+    {
+        unsigned count = 0;
+        for (auto &connection : mConnections)
+            if (connection.handle != AllConnections && connection.subscribed &&
+                (handle == AllConnections || connection.handle == handle))
+                count++;
+        return count;
+    }
+
+    // connection interval granted by the central, in units of 1.25 ms (0: not connected).
+    // For AllConnections the longest of all connections.
+    uint16_t getConnectionInterval(uint16_t handle = AllConnections)
+    {
+        uint16_t interval = 0;
+        for (auto &connection : mConnections)
+        {
+            if (connection.handle == AllConnections || (handle != AllConnections && connection.handle != handle))
+                continue;
+
+            ble_gap_conn_desc desc;
+            if (ble_gap_conn_find(connection.handle, &desc) == 0 && desc.conn_itvl > interval)
+                interval = desc.conn_itvl;
+        }
+        return interval;
     }
 
 protected:
-    void receive(uint8_t *buffer, size_t length)
+    bool pop(Connection &connection, byte *value)
+    {
+        if (RxRing)
+            return connection.rxRing.pop(*value);
+
+        // return 1 byte from the Queue
+        return xQueueReceive(connection.rxQueue, (void *)value, 0); // return immediately when the queue is empty
+    }
+
+    // RX streams, for mRxMerge
+    bool rxPop(unsigned slot, byte *value)
+    {
+        return pop(mConnections[slot], value);
+    }
+
+    bool rxConnected(unsigned slot)
+    {
+        return mConnections[slot].handle != AllConnections;
+    }
+
+    bool rxStale(unsigned slot)
+    {
+        return mConnections[slot].rxStale;
+    }
+
+    void rxClearStale(unsigned slot)
+    {
+        mConnections[slot].rxStale = false;
+    }
+
+    int findSlot(uint16_t handle)
     {
+        for (unsigned i = 0; i < _Settings::MaxConnections; i++)
+            if (mConnections[i].handle == handle)
+                return i;
+        return -1;
+    }
+
+    void receive(uint8_t *buffer, size_t length, uint16_t handle)
+    {
+        auto slot = findSlot(handle);
+        if (slot < 0)
+            return; // not one of ours (more centrals than MaxConnections)
+        mAddSlot = slot;
+
+        traffic();
+
         // forward the buffer so it can be parsed
         _bleMidiTransport->receive(buffer, length);
+
+        // publish all messages of this packet at once
+        if (RxRing)
+        {
+            mConnections[slot].rxRing.commit();
+            _bleMidiTransport->statistics().rxQueued(mConnections[slot].rxRing.used());
+        }
+        else
+            _bleMidiTransport->statistics().rxQueued(uxQueueMessagesWaiting(mConnections[slot].rxQueue));
+    }
+
+    void notifyFailed()
+    {
+        _bleMidiTransport->statistics().txFailed();
     }
 
-    void connected()
+    void queueRealTime(const uint8_t *buffer, size_t length)
     {
+        auto realTime = mTxRealTimeQueue.reserve();
+        if (!realTime)
+        {
+            _bleMidiTransport->statistics().txDropped();
+            return;
+        }
+
+        // the timestampHigh the transport stamped it with
+        realTime->connection = mTxConnection;
+        realTime->data[0] = _bleMidiTransport->realTimeHeader();
+        realTime->data[1] = buffer[length - 2];
+        realTime->data[2] = buffer[length - 1];
+        mTxRealTimeQueue.advance();
+        mTxRealTimeQueue.commit();
+    }
+
+    // MIDI is sent or received: short connection interval, see _Settings::UseAdaptiveInterval
+    void traffic()
+    {
+        if (!_Settings::UseAdaptiveInterval)
+            return;
+
+        mLastTraffic = millis();
+        if (!mTrafficActive)
+            activate();
+    }
+
+    // idle -> active: every connection gets the short interval, the state is shared by all
+    // (sender and BLE task may both get here, asking twice does no harm)
+    void activate()
+    {
+        mTrafficActive = true;
+        for (auto &connection : mConnections)
+            if (connection.handle != AllConnections)
+                requestInterval(connection.handle, true);
+    }
+
+    void requestInterval(uint16_t handle, bool active)
+    {
+        if (active)
+            _server->updateConnParams(handle, _Settings::ActiveIntervalMin, _Settings::ActiveIntervalMax, 0, _Settings::SupervisionTimeout);
+        else
+            _server->updateConnParams(handle, _Settings::IdleIntervalMin, _Settings::IdleIntervalMax, _Settings::IdleLatency, _Settings::SupervisionTimeout);
+    }
+
+    // timer task: relax the connection interval after IdleTimeout ms without traffic
+    static void idleCheck(TimerHandle_t timer)
+    {
+        auto self = static_cast<BLEMIDI_ESP32_NimBLE *>(pvTimerGetTimerID(timer));
+        if (!self->mTrafficActive || millis() - self->mLastTraffic < _Settings::IdleTimeout)
+            return;
+
+        self->mTrafficActive = false;
+        for (auto &connection : self->mConnections)
+            if (connection.handle != AllConnections)
+                self->requestInterval(connection.handle, false);
+    }
+
+    static void txTask(void *parameter)
+    {
+        auto self = static_cast<BLEMIDI_ESP32_NimBLE *>(parameter);
+
+        TxPacket packet;
+        TxRealTime realTime;
+        for (;;)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            // System Real-Time first, checked again before every packet of the queue
+            for (;;)
+            {
+                if (self->mTxRealTimeQueue.pop(realTime))
+                    self->txSent(realTime.data, sizeof(realTime.data), realTime.connection);
+                else if (self->mTxQueue.pop(packet))
+                    self->txSent(packet.data, packet.length, packet.connection);
+                else
+                    break;
+            }
+        }
+    }
+
+    // TX task: counted as sent when (at least) one central got it
+    void txSent(const byte *data, size_t length, uint16_t handle)
+    {
+        if (notify(data, length, handle, _Settings::TxRetries))
+            _bleMidiTransport->statistics().packetSent(length);
+    }
+
+    // every central that enabled notifications gets its own, true when one of them took it
+    bool notify(const byte *data, size_t length, uint16_t handle, unsigned retries)
+    {
+        bool sent = false;
+        for (auto &connection : mConnections)
+            if (connection.handle != AllConnections && connection.subscribed &&
+                (handle == AllConnections || connection.handle == handle))
+                sent |= notifyCentral(data, length, connection.handle, retries);
+        return sent;
+    }
+
+    // when the stack is out of buffers (congestion), wait for it and try again (TX task)
+    bool notifyCentral(const byte *data, size_t length, uint16_t handle, unsigned retries)
+    {
+        for (unsigned attempt = 0; attempt <= retries; attempt++)
+        {
+            auto om = ble_hs_mbuf_from_flat(data, length);
+            if (om)
+            {
+                auto rc = ble_gattc_notify_custom(handle, _characteristic->getHandle(), om);
+                if (rc == 0)
+                    return true;
+                if (rc != BLE_HS_ENOMEM)
+                    break; // e.g. the central is gone
+            }
+
+            if (attempt < retries)
+                vTaskDelay(1);
+        }
+
+        notifyFailed();
+        return false;
+    }
+
+    // all packets must fit every central
+    void updateMtu()
+    {
+        uint16_t mtu = 0;
+        for (auto &connection : mConnections)
+            if (connection.handle != AllConnections && (mtu == 0 || connection.mtu < mtu))
+                mtu = connection.mtu;
+
+        _bleMidiTransport->setMtu(mtu ? mtu : BLE_ATT_MTU_DFLT);
+    }
+
+    void connected(uint16_t handle)
+    {
+        // a free slot, preferably one the loop task has emptied already
+        auto slot = findSlot(AllConnections);
+        for (unsigned i = 0; i < _Settings::MaxConnections; i++)
+            if (mConnections[i].handle == AllConnections && !mConnections[i].rxStale)
+            {
+                slot = i;
+                break;
+            }
+        if (slot >= 0)
+        {
+            // until the central negotiates a larger MTU
+            mConnections[slot].mtu = BLE_ATT_MTU_DFLT;
+            mConnections[slot].subscribed = false;
+            mConnections[slot].handle = handle;
+            updateMtu();
+
+            if (_Settings::UseAdaptiveInterval)
+            {
+                // fast while the central sets up the connection, relaxed when idle
+                mLastTraffic = millis();
+                if (mTrafficActive)
+                    requestInterval(handle, true);
+                else
+                    activate(); // the others are idle, and would stay on the slow interval
+            }
+        }
+
+        // keep advertising, for the next central
+        if (connectionCount() < _Settings::MaxConnections)
+            _advertising->start();
+
         if (_bleMidiTransport->_connectedCallback)
             _bleMidiTransport->_connectedCallback();
     }
 
-    void disconnected()
+    void disconnected(uint16_t handle)
     {
+        auto slot = findSlot(handle);
+        if (slot >= 0)
+        {
+            mConnections[slot].handle = AllConnections;
+            mConnections[slot].subscribed = false;
+            updateMtu();
+
+            // not to be read as the bytes of the next central in this slot
+            if (!RxRing)
+                xQueueReset(mConnections[slot].rxQueue);
+            mConnections[slot].rxStale = true;
+        }
+
+        if (mTxConnection == handle)
+            mTxConnection = AllConnections;
+
         if (_bleMidiTransport->_disconnectedCallback)
             _bleMidiTransport->_disconnectedCallback();
     }
+
+    void subscribed(uint16_t handle, bool notify)
+    {
+        auto slot = findSlot(handle);
+        if (slot >= 0)
+            mConnections[slot].subscribed = notify;
+    }
+
+    void mtuChanged(uint16_t mtu, uint16_t handle)
+    {
+        auto slot = findSlot(handle);
+        if (slot < 0)
+            return;
+
+        mConnections[slot].mtu = mtu;
+        updateMtu();
+    }
 };
 
 template <class _Settings>
@@ -82,16 +552,22 @@ public:
 protected:
     BLEMIDI_ESP32_NimBLE<_Settings> *_bluetoothEsp32 = nullptr;
 
-    void onConnect(BLEServer *)
+    void onConnect(BLEServer *, ble_gap_conn_desc *desc)
     {
         if (_bluetoothEsp32)
-            _bluetoothEsp32->connected();
+            _bluetoothEsp32->connected(desc->conn_handle);
     };
 
-    void onDisconnect(BLEServer *)
+    void onDisconnect(BLEServer *, ble_gap_conn_desc *desc)
     {
         if (_bluetoothEsp32)
-            _bluetoothEsp32->disconnected();
+            _bluetoothEsp32->disconnected(desc->conn_handle);
+    }
+
+    void onMTUChange(uint16_t MTU, ble_gap_conn_desc *desc)
+    {
+        if (_bluetoothEsp32)
+            _bluetoothEsp32->mtuChanged(MTU, desc->conn_handle);
     }
 };
 
@@ -107,14 +583,40 @@ public:
 protected:
     BLEMIDI_ESP32_NimBLE<_Settings> *_bluetoothEsp32 = nullptr;
 
-    void onWrite(BLECharacteristic *characteristic)
+    // a received packet, copied out of the value of the characteristic
+    struct RxPacket
     {
-        std::string rxValue = characteristic->getValue();
+        byte data[_Settings::MaxBufferSize];
+    };
+
+    void onWrite(BLECharacteristic *characteristic, ble_gap_conn_desc *desc)
+    {
+#ifdef CONFIG_NIMBLE_CPP_ATT_VALUE_INIT_LENGTH
+        // NimBLE-Arduino 1.4 and later: copied from the value's buffer onto the stack, no allocation.
+        // begin() grew that buffer to MaxBufferSize bytes (it never shrinks), so all of RxPacket can be read.
+        auto length = characteristic->getDataLength();
+        if (length > 0 && length <= sizeof(RxPacket))
+        {
+            auto packet = characteristic->template getValue<RxPacket>(nullptr, true);
+            _bluetoothEsp32->receive(packet.data, length, desc->conn_handle);
+            return;
+        }
+#endif
+
+        // before 1.4, or a packet longer than MaxBufferSize: getValue() returns a copy on the heap
+        // (a std::string, or a NimBLEAttValue)
+        auto rxValue = characteristic->getValue();
         if (rxValue.length() > 0)
         {
-            _bluetoothEsp32->receive((uint8_t *)(rxValue.c_str()), rxValue.length());
+            _bluetoothEsp32->receive((uint8_t *)(rxValue.data()), rxValue.length(), desc->conn_handle);
         }
     }
+
+    // subValue: bit 0 notifications, bit 1 indications
+    void onSubscribe(BLECharacteristic *, ble_gap_conn_desc *desc, uint16_t subValue)
+    {
+        _bluetoothEsp32->subscribed(desc->conn_handle, subValue & 1);
+    }
 };
 
 template <class _Settings>
@@ -147,7 +649,9 @@ bool BLEMIDI_ESP32_NimBLE<_Settings>::begin(const char *deviceName, BLEMIDI_Tran
 
     // To communicate between the 2 cores.
     // Core_0 runs here, core_1 runs the BLE stack
-    mRxQueue = xQueueCreate(_Settings::MaxBufferSize, sizeof(uint8_t));
+    if (!RxRing)
+        for (auto &connection : mConnections)
+            connection.rxQueue = xQueueCreate(_Settings::MaxBufferSize, sizeof(uint8_t));
 
     _server = BLEDevice::createServer();
     _server->setCallbacks(new MyServerCallbacks<_Settings>(this));
@@ -164,11 +668,27 @@ bool BLEMIDI_ESP32_NimBLE<_Settings>::begin(const char *deviceName, BLEMIDI_Tran
             NIMBLE_PROPERTY::NOTIFY |
             NIMBLE_PROPERTY::WRITE_NR);
 
+#ifdef CONFIG_NIMBLE_CPP_ATT_VALUE_INIT_LENGTH
+    // room for a whole packet in the value's buffer, see MyCharacteristicCallbacks::onWrite
+    uint8_t empty[_Settings::MaxBufferSize] = {};
+    _characteristic->setValue(empty, sizeof(empty));
+    _characteristic->setValue(empty, 0);
+#endif
+
     _characteristic->setCallbacks(new MyCharacteristicCallbacks<_Settings>(this));
 
     // Start the service
     service->start();
 
+    if (_Settings::UseAdaptiveInterval)
+    {
+        mIdleTimer = xTimerCreate("BLEMIDI idle", pdMS_TO_TICKS(_Settings::IdleTimeout / 4 + 1), pdTRUE, this, idleCheck);
+        xTimerStart(mIdleTimer, 0);
+    }
+
+    if (_Settings::UseTxTask)
+        xTaskCreate(txTask, "BLEMIDI TX", _Settings::TxTaskStackSize, this, _Settings::TxTaskPriority, &mTxTask);
+
     // Start advertising
     _advertising = _server->getAdvertising();
     _advertising->addServiceUUID(service->getUUID());
@@ -0,0 +1,200 @@
+#pragma once
+
+// Loopback backend, no BLE stack involved.
+//
+// Every packet written by the transport is (optionally) fed straight back into
+// BLEMIDI_Transport::receive(), as if the peer had sent it. Packets can also be
+// injected with receive(). This backend compiles on the host (no Arduino core,
+// see BLEMIDI_Defs.h for the virtual millis() clock), so the encoder and decoder
+// can be measured and tested on a PC. See examples/Loopback_Benchmark
+//
+// Two instances can also be linked to each other (peer), with a simulated
+// connection interval, see examples/Loopback_Latency
+
+#include "../BLEMIDI_RingBuffer.h"
+
+BEGIN_BLEMIDI_NAMESPACE
+
+template <class _Settings>
+class BLEMIDI_Loopback
+{
+private:
+    BLEMIDI_Transport<class BLEMIDI_Loopback<_Settings>, _Settings> *_bleMidiTransport = nullptr;
+
+    // single threaded here, used as a plain FIFO
+    SpscRingBuffer<byte, _Settings::RxRingBufferSize> mRxBuffer;
+
+    // packets from the peer, until the connection event they arrive at
+    struct InFlight
+    {
+        unsigned long due; // millis()
+        size_t length;
+        uint8_t data[_Settings::MaxBufferSize];
+    };
+
+    SpscRingBuffer<InFlight, 8> mInFlight;
+
+public:
+    // feed every written packet back into the decoder
+    bool loopback = true;
+
+    // called for every written packet (optional)
+    void (*_writeCallback)(uint8_t *, size_t) = nullptr;
+
+    // send to this instance instead (loopback is ignored), at the next connection event:
+    // every connectionInterval ms of millis() (0: right away)
+    BLEMIDI_Loopback *peer = nullptr;
+    unsigned connectionInterval = 0;
+
+    size_t packetsWritten = 0;
+    size_t bytesWritten = 0;
+    size_t rxDropped = 0;   // add() found the FIFO full
+    size_t linkDropped = 0; // more packets in flight than the link holds
+
+public:
+    BLEMIDI_Loopback()
+    {
+    }
+
+    bool begin(const char *, BLEMIDI_Transport<class BLEMIDI_Loopback<_Settings>, _Settings> *bleMidiTransport)
+    {
+        _bleMidiTransport = bleMidiTransport;
+        return true;
+    }
+
+    void end()
+    {
+        mRxBuffer.flush();
+        mInFlight.flush();
+    }
+
+    bool write(uint8_t *buffer, size_t length)
+    {
+        packetsWritten++;
+        bytesWritten += length;
+
+        if (_writeCallback)
+            _writeCallback(buffer, length);
+
+        if (peer)
+            return peer->transmit(buffer, length, connectionInterval);
+        if (loopback)
+            receive(buffer, length);
+        return true;
+    }
+
+    // packets that go out right away: as many as the link holds, when linked
+    size_t txCredits()
+    {
+        return peer ? peer->mInFlight.space() : _Settings::TxCredits;
+    }
+
+    bool available(byte *pvBuffer)
+    {
+        // what the peer sent, as far as it has arrived by now
+        InFlight packet;
+        while (mInFlight.peek(packet) && (long)(millis() - packet.due) >= 0)
+        {
+            mInFlight.pop(packet);
+            receive(packet.data, packet.length);
+        }
+        mInFlight.release();
+
+        return mRxBuffer.pop(*pvBuffer);
+    }
+
+    bool add(byte value)
+    {
+        // called from BLE-MIDI, to add it to a buffer here
+        if (mRxBuffer.push(value))
+            return true;
+
+        rxDropped++;
+        return false;
+    }
+
+    // RX overflow policies (see _Settings::RxOverflow)
+
+    // single threaded: both ends of the ring are ours
+    bool peekOldest(byte *value)
+    {
+        mRxBuffer.commit();
+        return mRxBuffer.peek(*value);
+    }
+
+    bool popOldest(byte *value)
+    {
+        mRxBuffer.commit();
+        bool popped = mRxBuffer.pop(*value);
+        mRxBuffer.release();
+        return popped;
+    }
+
+    bool rxWait()
+    {
+        return false; // single threaded, nobody makes room while we wait
+    }
+
+    size_t rxFree()
+    {
+        return mRxBuffer.space();
+    }
+
+public:
+    // from the peer: arrives at the next connection event
+    bool transmit(uint8_t *buffer, size_t length, unsigned interval)
+    {
+        auto packet = mInFlight.reserve();
+        if (!packet || length > sizeof(packet->data))
+        {
+            linkDropped++;
+            return false;
+        }
+
+        packet->due = interval ? (millis() / interval + 1) * interval : millis();
+        packet->length = length;
+        memcpy(packet->data, buffer, length);
+        mInFlight.advance();
+        mInFlight.commit();
+        return true;
+    }
+
+    // inject a packet, as if received from the peer
+    void receive(uint8_t *buffer, size_t length)
+    {
+        _bleMidiTransport->receive(buffer, length);
+        mRxBuffer.commit();
+
+        _bleMidiTransport->statistics().rxQueued(mRxBuffer.used());
+    }
+
+    void connected()
+    {
+        if (_bleMidiTransport->_connectedCallback)
+            _bleMidiTransport->_connectedCallback();
+    }
+
+    void disconnected()
+    {
+        if (_bleMidiTransport->_disconnectedCallback)
+            _bleMidiTransport->_disconnectedCallback();
+    }
+};
+
+/*! \brief Create an instance for the loopback backend named <DeviceName>
+ */
+#define BLEMIDI_CREATE_CUSTOM_INSTANCE(DeviceName, Name, _Settings) \
+    BLEMIDI_NAMESPACE::BLEMIDI_Transport<BLEMIDI_NAMESPACE::BLEMIDI_Loopback<_Settings>, _Settings> BLE##Name(DeviceName); \
+    MIDI_NAMESPACE::MidiInterface<BLEMIDI_NAMESPACE::BLEMIDI_Transport<BLEMIDI_NAMESPACE::BLEMIDI_Loopback<_Settings>, _Settings>, BLEMIDI_NAMESPACE::MySettings> Name((BLEMIDI_NAMESPACE::BLEMIDI_Transport<BLEMIDI_NAMESPACE::BLEMIDI_Loopback<_Settings>, _Settings> &)BLE##Name);
+
+/*! \brief Create an instance for the loopback backend named <DeviceName>
+ */
+#define BLEMIDI_CREATE_INSTANCE(DeviceName, Name) \
+    BLEMIDI_CREATE_CUSTOM_INSTANCE(DeviceName, Name, BLEMIDI_NAMESPACE::DefaultSettings)
+
+/*! \brief Create a default instance for the loopback backend named BLE-MIDI
+ */
+#define BLEMIDI_CREATE_DEFAULT_INSTANCE() \
+    BLEMIDI_CREATE_INSTANCE("Loopback-MIDI", MIDI)
+
+END_BLEMIDI_NAMESPACE
@@ -30,8 +30,15 @@ public:
         
     }
 
-    void write(uint8_t* buffer, size_t length)
+    bool write(uint8_t* buffer, size_t length)
     {
+        return false;
+    }
+
+    size_t txCredits()
+    {
+        // write() holds nothing back, so a streamed SysEx still runs to its end
+        return _Settings::TxCredits;
     }
 
     bool available(byte* pvBuffer)
@@ -39,8 +46,29 @@ public:
         return false;
     }
 
-    void add(byte value)
+    bool add(byte value)
+    {
+        return false;
+    }
+
+    bool peekOldest(byte* value)
+    {
+        return false;
+    }
+
+    bool popOldest(byte* value)
+    {
+        return false;
+    }
+
+    bool rxWait()
+    {
+        return false;
+    }
+
+    size_t rxFree()
     {
+        return 0;
     }
 
 